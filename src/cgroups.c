@@ -20,16 +20,212 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
-#include <sys/queue.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/sysmacros.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/magic.h>
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <limits.h>
+#include <stddef.h>
+
+#ifndef CGROUP2_SUPER_MAGIC
+# define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+#ifndef SYS_pidfd_open
+# define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+# define SYS_pidfd_send_signal 424
+#endif
+
+/**
+ * Hierarchies used with cgroups v1. The named hierarchy is mandatory, the
+ * other ones are optional. CG_CPUACCT is usually the cpu,cpuacct hierarchy
+ * and is then also used for the cpu controller. CG_CPU is only used when
+ * the cpu controller is mounted in its own hierarchy. With cgroups v2, only
+ * the first one is used and it is the unified hierarchy.
+ */
+enum cg_hierarchy {
+	CG_NAMED,
+	CG_CPUACCT,
+	CG_CPU,
+	CG_MEMORY,
+	CG_CPUSET,
+	CG_BLKIO,
+	CG_PIDS,
+	CG_MAX
+};
+static const char *cg_roots[CG_MAX] = {
+	[CG_NAMED]   = CGROOT,
+	[CG_CPUACCT] = CGCPUACCT,
+	[CG_CPU]     = CGCPU,
+	[CG_MEMORY]  = CGMEMORY,
+	[CG_CPUSET]  = CGCPUSET,
+	[CG_BLKIO]   = CGBLKIO,
+	[CG_PIDS]    = CGPIDS,
+};
+
+/**
+ * Properties sampled repeatedly (by top). Their files are kept open in the
+ * handle and read again with pread().
+ */
+enum cg_sample {
+	CG_SAMPLE_CPU,
+	CG_SAMPLE_MEMORY,
+	CG_SAMPLE_MEMSTAT,
+	CG_SAMPLE_MEMPEAK,
+	CG_SAMPLE_MEMLIMIT,
+	CG_SAMPLE_MEMFAIL,
+	CG_SAMPLE_KMEM,
+	CG_SAMPLE_SWAP,
+	CG_SAMPLE_IOBYTES,
+	CG_SAMPLE_IOS,
+	CG_SAMPLE_PIDS,
+	CG_SAMPLE_PERCPU,
+	CG_SAMPLE_CPUSTAT,
+	CG_SAMPLE_OOM,
+	CG_SAMPLE_MAX
+};
+static const struct {
+	enum cg_hierarchy hierarchy;	/* Hierarchy (v1) */
+	const char *v1;			/* Property with cgroups v1 */
+	const char *v2;			/* Property with cgroups v2 */
+} cg_samples[CG_SAMPLE_MAX] = {
+	[CG_SAMPLE_CPU]    = { CG_CPUACCT, "cpuacct.usage", "cpu.stat" },
+	[CG_SAMPLE_MEMORY] = { CG_MEMORY, "memory.usage_in_bytes",
+			       "memory.current" },
+	[CG_SAMPLE_MEMSTAT] = { CG_MEMORY, "memory.stat", "memory.stat" },
+	[CG_SAMPLE_MEMPEAK] = { CG_MEMORY, "memory.max_usage_in_bytes",
+				"memory.peak" },
+	[CG_SAMPLE_MEMLIMIT] = { CG_MEMORY, "memory.limit_in_bytes",
+				 "memory.max" },
+	[CG_SAMPLE_MEMFAIL] = { CG_MEMORY, "memory.failcnt", "memory.events" },
+	[CG_SAMPLE_KMEM]    = { CG_MEMORY, "memory.kmem.usage_in_bytes", NULL },
+	[CG_SAMPLE_SWAP]    = { CG_MEMORY, NULL, "memory.swap.current" },
+	[CG_SAMPLE_IOBYTES] = { CG_BLKIO, "blkio.throttle.io_service_bytes",
+				"io.stat" },
+	[CG_SAMPLE_IOS]     = { CG_BLKIO, "blkio.throttle.io_serviced", NULL },
+	[CG_SAMPLE_PIDS]    = { CG_PIDS, "pids.current", "pids.current" },
+	[CG_SAMPLE_PERCPU]  = { CG_CPUACCT, "cpuacct.usage_percpu", NULL },
+	[CG_SAMPLE_CPUSTAT] = { CG_CPUACCT, "cpuacct.stat", "cpu.stat" },
+	[CG_SAMPLE_OOM]     = { CG_MEMORY, "memory.oom_control",
+				"memory.events" },
+};
+
+/**
+ * Handle to a namespace or a task. Directories are opened once in each
+ * hierarchy and all accesses are done relative to them.
+ */
+struct cg_handle {
+	char *namespace;	/* Namespace */
+	char *task;		/* Task name or NULL for the namespace */
+	ino_t inode;		/* Inode of the directory in named hierarchy */
+	int parent;		/* Namespace directory in named hierarchy or -1 */
+	int fd[CG_MAX];		/* Directory in each hierarchy or -1 */
+	int sample[CG_SAMPLE_MAX]; /* Sampled files, -1 if not opened yet,
+				    * -2 if not available */
+	int epfd;		/* epoll instance to wait for the task or -1 */
+	int inotify;		/* inotify instance to watch the task or -1 */
+	int notify[CG_MEMORY_EVENT_MAX]; /* Memory notifications or -1 */
+	uint64_t oom;		/* Last OOM counter seen (cgroups v2) */
+	struct pidset killed;	/* Processes signalled and watched */
+	int *pidfds;		/* pidfds of watched processes (-1 if exited) */
+	size_t npidfds;		/* Number of pidfds */
+	size_t alive;		/* Number of watched processes still alive */
+};
+
+/**
+ * Check if cgroups are mounted as a unified hierarchy (cgroups v2).
+ *
+ * With the unified hierarchy, everything happens in a single tree rooted at
+ * CGROOT: the namespace is a plain directory and each task is a
+ * subdirectory of it. Controllers are enabled through
+ * cgroup.subtree_control instead of being mounted separately. The result is
+ * cached since the layout of the host is not expected to change under us.
+ *
+ * @return 1 if the unified hierarchy is used, 0 otherwise
+ */
+int
+cg_unified(void)
+{
+	static int unified = -1;
+	if (unified == -1) {
+		struct statfs s;
+		unified = (statfs(CGROOT, &s) == 0 &&
+		    s.f_type == CGROUP2_SUPER_MAGIC);
+		log_debug("cgroups", "using cgroups %s",
+		    unified?"v2 (unified hierarchy)":"v1");
+	}
+	return unified;
+}
+
+/**
+ * Check if the cpu and cpuacct controllers share the same hierarchy
+ * (cgroups v1). CGCPU and CGCPUACCT are then both symlinks to it.
+ *
+ * @return 1 if they are co-mounted, 0 otherwise
+ */
+static int
+cg_cpu_comounted(void)
+{
+	static int comounted = -1;
+	if (comounted == -1) {
+		struct stat a, b;
+		comounted = (stat(CGCPU, &a) == 0 && stat(CGCPUACCT, &b) == 0 &&
+		    a.st_dev == b.st_dev && a.st_ino == b.st_ino);
+	}
+	return comounted;
+}
+
+/**
+ * Name of the file used to attach a PID to a cgroup.
+ */
+static const char *
+cg_tasks_file(void)
+{
+	return cg_unified()?"cgroup.procs":"tasks";
+}
+
+/**
+ * Name of the file listing the processes (or the threads) attached to a
+ * cgroup.
+ *
+ * @param threads List threads instead of processes.
+ */
+static const char *
+cg_pids_file(int threads)
+{
+	if (!threads) return "cgroup.procs";
+	return cg_unified()?"cgroup.threads":"tasks";
+}
+
+/**
+ * Get the directory of a handle in a given hierarchy.
+ *
+ * @param h         Handle.
+ * @param hierarchy Hierarchy (ignored with cgroups v2).
+ * @return a directory file descriptor or -1 if not available.
+ */
+static int
+cg_fd(struct cg_handle *h, enum cg_hierarchy hierarchy)
+{
+	return h->fd[cg_unified()?CG_NAMED:hierarchy];
+}
 
 /**
  * Set permissions on a given cgroup.
  *
+ * With cgroups v2, the files needed to delegate the subtree are also
+ * modified.
+ *
  * @param path Path to cgroup
  * @param uid  UID to use or -1 for no change
  * @param gid  GID to use or -1 for no change
@@ -38,49 +234,369 @@
 static int
 cg_fix_permissions(const char *path, uid_t uid, gid_t gid)
 {
+	static const char *v1files[] = { "tasks", NULL };
+	static const char *v2files[] = { "cgroup.procs", "cgroup.threads",
+					 "cgroup.subtree_control", NULL };
 	if (uid == -1 && gid == -1)
 		return 0;
 	if (chown(path, uid, gid) == -1)
 		return -1;
 
-	char *tasks = NULL;
-	if (asprintf(&tasks, "%s/tasks", path) == -1)
+	for (const char **file = cg_unified()?v2files:v1files; *file; file++) {
+		char *fpath = NULL;
+		if (asprintf(&fpath, "%s/%s", path, *file) == -1)
+			return -1;
+		if (chown(fpath, uid, gid) == -1) {
+			free(fpath);
+			return -1;
+		}
+		free(fpath);
+	}
+	return 0;
+}
+
+/**
+ * Set a property of a cgroup.
+ *
+ * @param dirfd    Directory of the cgroup.
+ * @param property Property to change.
+ * @param value    Value to set.
+ * @return 0 on success and -1 on error
+ */
+static int
+cg_write_property(int dirfd, const char *property, const char *value)
+{
+	log_debug("cgroups", "setting property %s=%s", property, value);
+	int fd = openat(dirfd, property, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		log_warn("cgroups", "unable to open %s", property);
 		return -1;
-	if (chown(tasks, uid, gid) == -1) {
-		free(tasks);
+	}
+	if (write(fd, value, strlen(value)) != strlen(value)) {
+		log_warn("cgroups", "unable to write to %s", property);
+		close(fd);
 		return -1;
 	}
-	free(tasks);
+	close(fd);
 	return 0;
 }
 
 /**
- * Release a task in the given namespace. Should be empty
+ * Set a property of a given cgroup.
  *
- * @param root      Root hierarchy to use.
- * @param namespace Namespace we need to find the task.
- * @param task      Task name.
- * @param log       Log function to use for logging errors.
+ * @param path     Path to cgroup.
+ * @param property Property to change.
+ * @param value    Value to set.
  * @return 0 on success and -1 on error
+ *
+ * This is really `echo value > path/property`.
  */
 static int
-_cg_release_task(const char *root, const char *namespace, const char *task,
-    void(*log)(const char *, const char *, ...))
+cg_set_property(const char *path, const char *property, const char *value)
 {
-	char *path = NULL;
-	if (asprintf(&path, "%s/lanco-%s/task-%s",
-		root, namespace, task) == -1) {
-		log("cgroups", "unable to allocate memory to check for task");
+	log_debug("cgroups", "setting property in %s", path);
+	int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1) {
+		log_warn("cgroups", "unable to open %s", path);
 		return -1;
 	}
-	if (rmdir(path) == -1) {
-		log("cgroups", "unable to remove directory %s", path);
-		free(path);
+	int rc = cg_write_property(dirfd, property, value);
+	close(dirfd);
+	return rc;
+}
+
+/**
+ * Terminate a property read from a cgroup.
+ *
+ * @param buf Buffer containing the property.
+ * @param n   Number of bytes read or -1 on error.
+ * @return the length of the property or -1 if empty
+ */
+static ssize_t
+cg_terminate_property(char *buf, ssize_t n)
+{
+	if (n == -1) return -1;
+	buf[n] = '\0';
+	if (n > 0 && buf[n - 1] == '\n')
+		buf[--n] = '\0';
+	return (n > 0)?n:-1;
+}
+
+/**
+ * Get a property of a cgroup.
+ *
+ * @param dirfd    Directory of the cgroup or -1 if not available.
+ * @param property Property to get.
+ * @param buf      Buffer to store the property.
+ * @param len      Size of the buffer.
+ * @return the length of the property or -1 on error
+ *
+ * The content is NULL-terminated and the trailing newline is removed. An
+ * empty property is an error.
+ */
+static ssize_t
+cg_read_property(int dirfd, const char *property, char *buf, size_t len)
+{
+	if (dirfd == -1) return -1;
+	int fd = openat(dirfd, property, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		log_debug("cgroups", "unable to open %s", property);
+		return -1;
+	}
+	ssize_t n = read(fd, buf, len - 1);
+	close(fd);
+	if (n == -1)
+		log_warn("cgroups", "unable to read property %s", property);
+	return cg_terminate_property(buf, n);
+}
+
+/**
+ * Sample a property of a cgroup.
+ *
+ * The file is opened on first use and kept open in the handle. Subsequent
+ * reads are done with pread() at offset 0: the kernel generates a fresh
+ * content each time.
+ *
+ * @param h      Handle.
+ * @param sample Property to sample.
+ * @param buf    Buffer to store the property.
+ * @param len    Size of the buffer.
+ * @return the length of the property or -1 on error
+ */
+static ssize_t
+cg_sample_property(struct cg_handle *h, enum cg_sample sample,
+    char *buf, size_t len)
+{
+	int *fd = &h->sample[sample];
+	const char *property = cg_unified()?
+	    cg_samples[sample].v2:cg_samples[sample].v1;
+	if (*fd == -2) return -1;
+	if (*fd == -1) {
+		int dirfd = cg_fd(h, cg_samples[sample].hierarchy);
+		if (dirfd == -1 || property == NULL ||
+		    (*fd = openat(dirfd, property, O_RDONLY | O_CLOEXEC)) == -1) {
+			log_debug("cgroups", "unable to open %s",
+			    property?property:"property");
+			*fd = -2;
+			return -1;
+		}
+	}
+	ssize_t n = pread(*fd, buf, len - 1, 0);
+	if (n == -1)
+		log_warn("cgroups", "unable to read property %s", property);
+	return cg_terminate_property(buf, n);
+}
+
+/**
+ * Get a single counter from a sampled cgroup file.
+ *
+ * @param h      Handle.
+ * @param sample Property to sample.
+ * @param key    Key of the counter for "key value" files or NULL if the file
+ *               only contains a value.
+ * @param value  Where to store the value.
+ * @return 0 on success, -1 if not available
+ */
+static int
+cg_sample_counter(struct cg_handle *h, enum cg_sample sample,
+    const char *key, uint64_t *value)
+{
+	char buf[1024];
+	if (cg_sample_property(h, sample, buf, sizeof(buf)) == -1)
 		return -1;
+	char *start = buf;
+	if (key != NULL) {
+		size_t len = strlen(key);
+		for (start = buf; start != NULL; start = strchr(start, '\n')) {
+			if (*start == '\n') start++;
+			if (!strncmp(start, key, len) && start[len] == ' ')
+				break;
+		}
+		if (start == NULL) return -1;
+		start += len + 1;
 	}
+	*value = strtoull(start, NULL, 10);
 	return 0;
 }
 
+/**
+ * Check if a cgroup still has some processes (cgroups v2 only).
+ *
+ * @param dirfd Directory of the cgroup.
+ * @return 1 if the cgroup is populated, 0 otherwise
+ */
+static int
+cg2_is_populated(int dirfd)
+{
+	char events[256];
+	if (cg_read_property(dirfd, "cgroup.events",
+		events, sizeof(events)) == -1)
+		return 0;
+	char *populated = strstr(events, "populated ");
+	return (populated != NULL &&
+	    populated[strlen("populated ")] != '0');
+}
+
+/**
+ * Open a directory relative to another one.
+ *
+ * @param dirfd Parent directory or -1.
+ * @param path  Path to the directory.
+ * @return a file descriptor or -1 on error
+ */
+static int
+cg_opendir(int dirfd, const char *path)
+{
+	if (dirfd == -1) return -1;
+	return openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Release a handle.
+ *
+ * @param h Handle to release. May be NULL.
+ */
+void
+cg_close(struct cg_handle *h)
+{
+	if (h == NULL) return;
+	for (int i = 0; i < CG_SAMPLE_MAX; i++)
+		if (h->sample[i] >= 0) close(h->sample[i]);
+	for (size_t i = 0; i < h->npidfds; i++)
+		if (h->pidfds[i] != -1) close(h->pidfds[i]);
+	free(h->pidfds);
+	pidset_free(&h->killed);
+	if (h->inotify != -1) close(h->inotify);
+	for (int i = 0; i < CG_MEMORY_EVENT_MAX; i++)
+		if (h->notify[i] != -1) close(h->notify[i]);
+	if (h->epfd != -1) close(h->epfd);
+	for (int i = 0; i < CG_MAX; i++)
+		if (h->fd[i] != -1) close(h->fd[i]);
+	if (h->parent != -1) close(h->parent);
+	free(h->namespace);
+	free(h->task);
+	free(h);
+}
+
+/**
+ * Get a handle to a namespace or a task.
+ *
+ * The directory in the named hierarchy (or in the unified hierarchy) has to
+ * exist. Other hierarchies are optional.
+ *
+ * @param namespace Namespace.
+ * @param task      Task name or NULL for the namespace itself.
+ * @return a handle or NULL if the namespace or the task does not exist.
+ */
+struct cg_handle *
+cg_open(const char *namespace, const char *task)
+{
+	struct cg_handle *h = calloc(1, sizeof(struct cg_handle));
+	if (h == NULL) {
+		log_warn("cgroups", "unable to allocate memory for cgroup handle");
+		return NULL;
+	}
+	h->parent = -1;
+	h->epfd = -1;
+	h->inotify = -1;
+	pidset_init(&h->killed);
+	for (int i = 0; i < CG_MAX; i++) h->fd[i] = -1;
+	for (int i = 0; i < CG_SAMPLE_MAX; i++) h->sample[i] = -1;
+	for (int i = 0; i < CG_MEMORY_EVENT_MAX; i++) h->notify[i] = -1;
+	if ((h->namespace = strdup(namespace)) == NULL ||
+	    (task && (h->task = strdup(task)) == NULL)) {
+		log_warn("cgroups", "unable to allocate memory for cgroup handle");
+		goto error;
+	}
+
+	char name[NAME_MAX + 1];
+	for (int i = 0; i < CG_MAX; i++) {
+		if (cg_unified() && i != CG_NAMED) break;
+		if (i == CG_CPU && cg_cpu_comounted()) continue;
+		int root = open(cg_roots[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		snprintf(name, sizeof(name), "lanco-%s", namespace);
+		int nsfd = cg_opendir(root, name);
+		if (root != -1) close(root);
+		if (task == NULL) {
+			h->fd[i] = nsfd;
+			continue;
+		}
+		snprintf(name, sizeof(name), "task-%s", task);
+		h->fd[i] = cg_opendir(nsfd, name);
+		if (i == CG_NAMED) h->parent = nsfd;
+		else if (nsfd != -1) close(nsfd);
+	}
+	if (h->fd[CG_NAMED] == -1) {
+		log_debug("cgroups", "%s%s does not exist in namespace %s",
+		    task?"task ":"", task?task:"root", namespace);
+		goto error;
+	}
+
+	struct stat a;
+	if (fstat(h->fd[CG_NAMED], &a) == -1) {
+		log_warn("cgroups", "unable to stat task %s", task?task:"root");
+		goto error;
+	}
+	h->inode = a.st_ino;
+	return h;
+
+error:
+	cg_close(h);
+	return NULL;
+}
+
+/**
+ * Check if a task handle is still valid.
+ *
+ * The task directory should still be present with the same inode. With
+ * cgroups v2, the task should also not be empty since there is no release
+ * agent to remove it.
+ *
+ * @param h Handle to check.
+ * @return 1 if the handle is valid, 0 otherwise
+ */
+int
+cg_valid(struct cg_handle *h)
+{
+	if (h->task == NULL) return 1;
+
+	char name[NAME_MAX + 1];
+	struct stat a;
+	snprintf(name, sizeof(name), "task-%s", h->task);
+	if (fstatat(h->parent, name, &a, AT_SYMLINK_NOFOLLOW) == -1) {
+		log_debug("cgroups", "task %s does not exist in namespace %s",
+		    h->task, h->namespace);
+		return 0;
+	}
+	if (!S_ISDIR(a.st_mode)) {
+		log_warnx("cgroups", "task %s is not a directory", h->task);
+		return 0;
+	}
+	if (a.st_ino != h->inode) {
+		log_debug("cgroups", "task %s exists but not the right inode",
+		    h->task);
+		return 0;
+	}
+	if (cg_unified() && !cg2_is_populated(h->fd[CG_NAMED])) {
+		log_debug("cgroups", "task %s in namespace %s is empty",
+		    h->task, h->namespace);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Inode of the task directory in the named hierarchy.
+ *
+ * @param h Handle.
+ * @return the inode
+ */
+ino_t
+cg_inode(struct cg_handle *h)
+{
+	return h->inode;
+}
+
 /**
  * Release a task in the given namespace. Nobody should be in the task.
  *
@@ -91,69 +607,80 @@ _cg_release_task(const char *root, const char *namespace, const char *task,
 int
 cg_release_task(const char *namespace, const char *task)
 {
-	if (_cg_release_task(CGMEMORY, namespace, task, log_debug) == -1) {
-		log_debug("cgroups", "unable to release task to a memory cgroup");
-		log_debug("cgroups", "no future memory accounting for task %s", task);
+	struct cg_handle *ns = cg_open(namespace, NULL);
+	if (ns == NULL) {
+		log_warnx("cgroups", "namespace %s does not exist", namespace);
+		return -1;
 	}
-	if (_cg_release_task(CGCPUACCT, namespace, task, log_debug) == -1) {
-		log_info("cgroups", "unable to release task to a cpuacct cgroup");
-		log_info("cgroups", "no future CPU accounting for task %s", task);
+
+	char name[NAME_MAX + 1];
+	snprintf(name, sizeof(name), "task-%s", task);
+	for (int i = CG_MAX - 1; i >= 0; i--) {
+		if (ns->fd[i] == -1) continue;
+		if (unlinkat(ns->fd[i], name, AT_REMOVEDIR) == -1) {
+			if (i == CG_NAMED) {
+				log_warn("cgroups", "unable to remove task %s",
+				    task);
+				cg_close(ns);
+				return -1;
+			}
+			log_debug("cgroups", "unable to release task %s in %s",
+			    task, cg_roots[i]);
+			log_debug("cgroups", "no future accounting in %s for task %s",
+			    cg_roots[i], task);
+		}
 	}
-	if (_cg_release_task(CGROOT, namespace, task, log_warn) == -1)
-		return -1;
+	cg_close(ns);
 	return 0;
 }
 
 /**
- * Create a new task in the given namespace. Also move ourself in this task.
+ * Create a new task in a given hierarchy. Also move ourself in this task.
  *
- * @param root      Root hierarchy to use for the new task.
- * @param namespace Namespace we need to find the task.
+ * @param nsfd      Namespace directory in the hierarchy.
  * @param task      Task name.
  * @param log       Log function to use for logging errors.
  * @return 0 on success and -1 on error
  */
 static int
-_cg_create_task(const char *root, const char *namespace, const char *task,
+_cg_create_task(int nsfd, const char *task,
     void(*log)(const char *, const char *, ...))
 {
 	int rc = -1;
-	char *path = NULL;
-	char *tasks = NULL;
-	if (asprintf(&path, "%s/lanco-%s/task-%s",
-		root, namespace, task) == -1 ||
-	    asprintf(&tasks, "%s/tasks", path) == -1) {
-		log("cgroups", "unable to allocate memory to check for task");
-		free(path);
-		return -1;
-	}
-	if (mkdir(path, 0755) == -1) {
-		log("cgroups", "unable to create directory %s", path);
-		free(path);
-		free(tasks);
-		return -1;
+	int fd = -1;
+	char name[NAME_MAX + 1];
+	snprintf(name, sizeof(name), "task-%s", task);
+	if (mkdirat(nsfd, name, 0755) == -1) {
+		int reuse = 0;
+		/* With cgroups v2, an empty cgroup is not released
+		 * automatically */
+		if (errno == EEXIST && cg_unified()) {
+			fd = cg_opendir(nsfd, name);
+			reuse = (fd != -1 && !cg2_is_populated(fd));
+			if (fd != -1) close(fd);
+		}
+		if (!reuse) {
+			log("cgroups", "unable to create directory for task %s",
+			    task);
+			return -1;
+		}
 	}
 
 	/* Move ourself to the task */
-	log_debug("cgroups", "move ourself into %s", path);
-	FILE *taskfile = fopen(tasks, "w");
-	if (taskfile == NULL) {
-		log("cgroups", "unable to open tasks file in %s", path);
-		goto end;
-	}
-	if (fprintf(taskfile, "%d", getpid()) < 0) {
+	log_debug("cgroups", "move ourself into task %s", task);
+	char pid[32];
+	snprintf(pid, sizeof(pid), "%d", getpid());
+	if ((fd = cg_opendir(nsfd, name)) == -1 ||
+	    cg_write_property(fd, cg_tasks_file(), pid) == -1) {
 		log("cgroups", "unable to move ourself in task %s", task);
-		fclose(taskfile);
 		goto end;
 	}
-	fclose(taskfile);
 
 	rc = 0;
 end:
-	if (rc == -1 && rmdir(path) == -1)
-		log("cgroups", "unable to remove task dir %s", path);
-	free(path);
-	free(tasks);
+	if (fd != -1) close(fd);
+	if (rc == -1 && unlinkat(nsfd, name, AT_REMOVEDIR) == -1)
+		log("cgroups", "unable to remove task dir for %s", task);
 	return rc;
 }
 
@@ -167,199 +694,404 @@ end:
 int
 cg_create_task(const char *namespace, const char *task)
 {
-	if (_cg_create_task(CGROOT, namespace, task, log_warn) == -1)
+	struct cg_handle *ns = cg_open(namespace, NULL);
+	if (ns == NULL) {
+		log_warnx("cgroups", "namespace %s does not exist", namespace);
+		return -1;
+	}
+	if (_cg_create_task(ns->fd[CG_NAMED], task, log_warn) == -1) {
+		cg_close(ns);
 		return -1;
-	if (_cg_create_task(CGCPUACCT, namespace, task, log_debug) == -1) {
-		log_info("cgroups", "unable to assign task to a cpuacct cgroup");
-		log_info("cgroups", "no CPU accounting for task %s", task);
 	}
-	if (_cg_create_task(CGMEMORY, namespace, task, log_debug) == -1) {
-		log_debug("cgroups", "unable to assign task to a memory cgroup");
-		log_debug("cgroups", "no memory accounting for task %s", task);
+	for (int i = CG_NAMED + 1; i < CG_MAX; i++) {
+		if (ns->fd[i] == -1) {
+			/* Optional hierarchy not mounted */
+			log_debug("cgroups", "no %s hierarchy for task %s",
+			    cg_roots[i], task);
+			continue;
+		}
+		if (_cg_create_task(ns->fd[i], task, log_warn) == -1)
+			log_warnx("cgroups", "task %s not created in %s hierarchy",
+			    task, cg_roots[i]);
 	}
+	cg_close(ns);
 	return 0;
 }
 
 /**
  * Check if a given task exist.
  *
+ * With cgroups v2, there is no release agent. A task whose cgroup is empty is
+ * considered as not existing. Its cgroup is left for an explicit release or
+ * for reuse by cg_create_task().
+ *
  * @param namespace Namespace we need to find the task.
  * @param task      Task name.
- * @param inode When not NULL, store task inode if task is found. When not 0,
- *              check if this is the right inode.
- * @return 1 if the namespace exists, 0 otherwise
+ * @return 1 if the task exists, 0 otherwise
  */
 int
-cg_exist_task(const char *namespace, const char *task, ino_t *inode)
+cg_exist_task(const char *namespace, const char *task)
 {
-	char *path = NULL;
-	if (asprintf(&path, "%s/lanco-%s/task-%s",
-		CGROOT, namespace, task) == -1) {
-		log_warn("cgroups", "unable to allocate memory to check for task");
-		return 0;
-	}
+	struct cg_handle *h = cg_open(namespace, task);
+	if (h == NULL) return 0;
+	int exist = cg_valid(h);
+	cg_close(h);
+	if (exist)
+		log_debug("cgroups", "task %s exists in namespace %s",
+		    task, namespace);
+	return exist;
+}
 
-	struct stat a;
-	if (stat(path, &a) == -1) {
-		log_debug("cgroups", "task %s does not exist in namespace %s", task,
-			namespace);
-		free(path);
-		return 0;
-	}
-	if (!S_ISDIR(a.st_mode)) {
-		log_warnx("cgroups", "%s is not a directory", path);
-		free(path);
-		return 0;
+/**
+ * Kill all processes of a task at once with cgroup.kill.
+ *
+ * This is only available with cgroups v2 on Linux 5.14+. The kernel sends
+ * SIGKILL to the whole subtree, including processes forked while we are
+ * killing.
+ *
+ * @param h Task handle.
+ * @return 1 if the task has been killed, 0 if cgroup.kill is not available,
+ *         -1 on error.
+ */
+static int
+cg2_kill_all(struct cg_handle *h)
+{
+	int fd = openat(h->fd[CG_NAMED], "cgroup.kill", O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			log_debug("cgroups", "no cgroup.kill for task %s",
+			    h->task);
+			return 0;
+		}
+		log_warn("cgroups", "unable to open cgroup.kill for task %s",
+		    h->task);
+		return -1;
 	}
-	free(path);
-	if (inode && *inode > 0 && *inode != a.st_ino) {
-		log_debug("cgroups", "task %s exists but not the right inode", task);
-		return 0;
+	if (write(fd, "1", 1) != 1) {
+		log_warn("cgroups", "unable to write to cgroup.kill for task %s",
+		    h->task);
+		close(fd);
+		return -1;
 	}
-	if (inode) *inode = a.st_ino;
-
-	log_debug("cgroups", "task %s exists in namespace %s", task, namespace);
+	close(fd);
 	return 1;
 }
 
-struct one_pid {
-	TAILQ_ENTRY(one_pid) next;
-	pid_t pid;
-};
 /**
- * Kill a task.
+ * Open the list of PIDs of a task.
  *
- * To avoid race condition, the inode of the task directory, as provided by
- * cg_exist_task() should be provided. Killing is not recursive.
+ * @param h       Task handle.
+ * @param threads List threads instead of processes.
+ * @return a stream or NULL on error. errno is ENOENT if the task has vanished.
+ */
+static FILE *
+cg_open_pids(struct cg_handle *h, int threads)
+{
+	int fd = openat(h->fd[CG_NAMED], cg_pids_file(threads),
+	    O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return NULL;
+	FILE *pids = fdopen(fd, "r");
+	if (pids == NULL) close(fd);
+	return pids;
+}
+
+/**
+ * Check if a process belongs to a task, according to /proc/PID/cgroup.
  *
- * @param namespace Namespace we need to find the task.
- * @param task      Task name.
- * @param inode     Task inode or 0 to not check it.
- * @param signal    Signal to send.
- * @return 0 on success and -1 on error
+ * @param h   Task handle.
+ * @param pid Process to check.
+ * @return 1 if the process belongs to the task, 0 otherwise
  */
-int
-cg_kill_task(const char *namespace, const char *task, ino_t inode, int signal)
+static int
+cg_is_member(struct cg_handle *h, pid_t pid)
 {
-	int rc = -1;
-	char *dirpath = NULL;
-	char *taskspath = NULL;
-	DIR *dir = NULL;
-	FILE *tasks = NULL;
-	TAILQ_HEAD(, one_pid) pids;
-	TAILQ_INIT(&pids);
-
-	if (asprintf(&dirpath, "%s/lanco-%s/task-%s",
-		CGROOT, namespace, task) == -1 ||
-	    asprintf(&taskspath, "%s/tasks", dirpath) == -1) {
-		log_warn("cgroups", "unable to allocate memory to check for task");
-		rc = 0;
-		goto end;
+	char path[64], buf[4096], expected[2 * NAME_MAX + 32];
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return 0;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) return 0;
+	buf[n] = '\0';
+
+	/* With cgroups v1, we look for "N:name=lanco-NS:/task-TASK". With
+	 * cgroups v2, we look for "0::/.../lanco-NS/task-TASK". */
+	snprintf(expected, sizeof(expected),
+	    cg_unified()?"/lanco-%s/task-%s":":name=lanco-%s:/task-%s",
+	    h->namespace, h->task);
+	size_t len = strlen(expected);
+	for (char *line = buf, *next; line != NULL; line = next) {
+		if ((next = strchr(line, '\n')) != NULL) *next++ = '\0';
+		if (cg_unified() && strncmp(line, "0::", 3)) continue;
+		size_t llen = strlen(line);
+		if (llen >= len && !strcmp(line + llen - len, expected))
+			return 1;
 	}
+	return 0;
+}
 
-	int done;
-	do {
-		done = 1;
-		log_debug("cgroups", "locate tasks file in %s", dirpath);
-		struct stat a;
-		if (inode > 0) {
-			if ((dir = opendir(dirpath)) == NULL) {
-				if (errno == ENOENT) {
-					log_debug("cgroups", "task %s has vanished", task);
-					rc = 0;
-					goto end;
-				}
-				log_warn("cgroups", "unable to open %s", dirpath);
-				goto end;
-			}
+/**
+ * Get the epoll instance used to wait for a task.
+ *
+ * @param h Task handle.
+ * @return a file descriptor or -1 on error
+ */
+static int
+cg_epoll(struct cg_handle *h)
+{
+	if (h->epfd == -1 &&
+	    (h->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		log_warn("cgroups", "unable to create epoll instance for task %s",
+		    h->task);
+	return h->epfd;
+}
 
-			/* Check inode */
-			if (fstat(dirfd(dir), &a) == -1) {
-				log_warn("cgroups", "unable to stat %s", dirpath);
-				goto end;
-			}
-			if (a.st_ino != inode) {
-				log_debug("cgroups", "task %s does not have the right inode",
-				    task);
-				rc = 0;
-				goto end;
-			}
-			log_debug("cgroups", "task %s has the correct inode number",
-			    task);
+/**
+ * Watch a process through its pidfd. The pidfd becomes readable when the
+ * process exits.
+ *
+ * @param h     Task handle.
+ * @param pid   Process to watch.
+ * @param pidfd pidfd of the process. It is owned by the handle after this
+ *              call.
+ */
+static void
+cg_watch_pidfd(struct cg_handle *h, pid_t pid, int pidfd)
+{
+	if (pidset_contains(&h->killed, pid) || cg_epoll(h) == -1) {
+		/* Already watched (or unable to watch) */
+		close(pidfd);
+		return;
+	}
+	int *pidfds = realloc(h->pidfds, (h->npidfds + 1) * sizeof(int));
+	if (pidfds == NULL) {
+		log_warn("cgroups", "unable to allocate memory to watch PID %d",
+		    pid);
+		close(pidfd);
+		return;
+	}
+	h->pidfds = pidfds;
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.u64 = h->npidfds
+	};
+	if (epoll_ctl(h->epfd, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+		log_warn("cgroups", "unable to watch PID %d", pid);
+		close(pidfd);
+		return;
+	}
+	/* Only record the PID once it is watched */
+	if (pidset_add(&h->killed, pid) == -1) {
+		epoll_ctl(h->epfd, EPOLL_CTL_DEL, pidfd, NULL);
+		close(pidfd);
+		return;
+	}
+	h->pidfds[h->npidfds++] = pidfd;
+	h->alive++;
+}
+
+/**
+ * Send a signal to a process of a task.
+ *
+ * When possible, the process is pinned with a pidfd and we check it still
+ * belongs to the task before signalling it. This way, a PID recycled after
+ * being read from the task is never signalled. The pidfd is then kept to
+ * know when the process exits.
+ *
+ * @param h      Task handle.
+ * @param pid    Process to signal.
+ * @param signal Signal to send.
+ */
+void
+cg_kill_pid(struct cg_handle *h, pid_t pid, int signal)
+{
+	static int nopidfd = 0;
+	int pidfd = -1;
+	if (!nopidfd &&
+	    (pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1 &&
+	    errno == ENOSYS) {
+		log_debug("cgroups", "pidfd not supported, use PID to signal");
+		nopidfd = 1;
+	}
+	if (nopidfd) {
+		log_debug("cgroups", "kill PID %d for task %s", pid, h->task);
+		kill(pid, signal);
+		return;
+	}
+	if (pidfd == -1) {
+		log_debug("cgroups", "PID %d for task %s has vanished",
+		    pid, h->task);
+		return;
+	}
+	if (!cg_is_member(h, pid)) {
+		log_debug("cgroups", "PID %d does not belong to task %s anymore",
+		    pid, h->task);
+		close(pidfd);
+		return;
+	}
+	log_debug("cgroups", "kill PID %d for task %s", pid, h->task);
+	if (syscall(SYS_pidfd_send_signal, pidfd, signal, NULL, 0) == -1) {
+		log_debug("cgroups", "unable to signal PID %d", pid);
+		close(pidfd);
+		return;
+	}
+	cg_watch_pidfd(h, pid, pidfd);
+}
+
+/**
+ * Kill a task.
+ *
+ * All accesses are done relative to the task directory opened with the
+ * handle. If the task is released and a new one is started with the same
+ * name, we won't kill it. Processes are signalled through pidfds when
+ * available. Killing is not recursive, except when SIGKILL can be
+ * delivered through cgroup.kill.
+ *
+ * @param h         Task handle.
+ * @param signal    Signal to send.
+ * @return 0 on success and -1 on error
+ */
+int
+cg_kill_task(struct cg_handle *h, int signal)
+{
+	int rc = -1;
+	FILE *tasks = NULL;
+	struct pidset pids;
+	pidset_init(&pids);
+
+	if (signal == SIGKILL && cg_unified()) {
+		switch (cg2_kill_all(h)) {
+		case 1:
+			log_debug("cgroups", "task %s killed with cgroup.kill",
+			    h->task);
+			return 0;
+		case -1:
+			return -1;
 		}
+	}
 
-		if ((tasks = fopen(taskspath, "r")) == NULL) {
+	int done;
+	do {
+		done = 1;
+		if ((tasks = cg_open_pids(h, 0)) == NULL) {
 			if (errno == ENOENT) {
-				log_debug("cgroups", "task %s has vanished", task);
+				log_debug("cgroups", "task %s has vanished", h->task);
 				rc = 0;
 				goto end;
 			}
-			log_warn("cgroups", "unable to open %s", taskspath);
+			log_warn("cgroups", "unable to open PID list for task %s",
+			    h->task);
 			goto end;
 		}
 
-		/* Check inode */
-		if (inode > 0) {
-			if (fstat(fileno(tasks), &a) == -1) {
-				log_warn("cgroups", "unable to stat %s",
-				    taskspath);
-				goto end;
-			}
-			struct dirent *dirent;
-			while ((dirent = readdir(dir))) {
-				if (dirent->d_ino == a.st_ino) break;
-			}
-			if (dirent == NULL) {
-				log_debug("cgroups", "tasks file %s has changed",
-				    taskspath);
-				log_debug("cgroups", "task %s has vanished",
-				    task);
-				rc = 0;
-				goto end;
-			}
-		}
-		closedir(dir); dir = NULL;
-
-		log_debug("cgroups", "kill everybody in task %s", task);
+		log_debug("cgroups", "kill everybody in task %s", h->task);
 		pid_t pid;
 		while (fscanf(tasks, "%d", &pid) == 1) {
-			int found = 0;
-			struct one_pid *new;
-			TAILQ_FOREACH(new, &pids, next) {
-				if (new->pid == pid) {
-					found = 1;
-					break;
-				}
-			}
-			if (found) continue;
-			if ((new = malloc(sizeof(struct one_pid))) == NULL) {
-				log_warn("cgroups", "memory allocation failure");
-				goto end;
+			switch (pidset_add(&pids, pid)) {
+			case 0: continue;
+			case -1: goto end;
 			}
-			log_debug("cgroups", "kill PID %d for task %s", pid, task);
-			kill(pid, signal);
-			new->pid = pid;
-			TAILQ_INSERT_TAIL(&pids, new, next);
+			cg_kill_pid(h, pid, signal);
 			done = 0;
 		}
 		fclose(tasks); tasks = NULL;
 	} while (!done);
-	log_debug("cgroups", "no mode PID to kill in task %s", task);
+	log_debug("cgroups", "no mode PID to kill in task %s", h->task);
 
 	rc = 0;
 end:
-	while (!TAILQ_EMPTY(&pids)) {
-		struct one_pid *first = TAILQ_FIRST(&pids);
-		TAILQ_REMOVE(&pids, first, next);
-		free(first);
-	}
-	if (dir != NULL) closedir(dir);
+	pidset_free(&pids);
 	if (tasks != NULL) fclose(tasks);
-	free(dirpath);
-	free(taskspath);
 	return rc;
 }
 
+/**
+ * Watch a task to know when it vanishes.
+ *
+ * The returned file descriptor becomes readable when something happens to
+ * the task. It can be polled along with other file descriptors, then
+ * cg_watch_events() should be called. It is an epoll instance watching the
+ * pidfds of the processes signalled by cg_kill_task(): they become readable
+ * when each process exits. It also watches an inotify instance: with
+ * cgroups v1, the release agent removes the task directory from the
+ * namespace directory; with cgroups v2, cgroup.events is modified when the
+ * task becomes empty.
+ *
+ * Since we may miss some events, the task should also be checked from time
+ * to time with cg_watch_events().
+ *
+ * @param h Task handle.
+ * @return a file descriptor or -1 on error
+ */
+int
+cg_watch_task(struct cg_handle *h)
+{
+	if (h->inotify != -1) return h->epfd;
+	if (cg_epoll(h) == -1) return -1;
+
+	char path[64];
+	if ((h->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		log_warn("cgroups", "unable to use inotify to watch task %s",
+		    h->task);
+		return -1;
+	}
+	if (cg_unified())
+		snprintf(path, sizeof(path), "/proc/self/fd/%d/cgroup.events",
+		    h->fd[CG_NAMED]);
+	else
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", h->parent);
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.u64 = UINT64_MAX
+	};
+	if (inotify_add_watch(h->inotify, path,
+		cg_unified()?IN_MODIFY:IN_DELETE) == -1 ||
+	    epoll_ctl(h->epfd, EPOLL_CTL_ADD, h->inotify, &event) == -1) {
+		log_warn("cgroups", "unable to watch task %s", h->task);
+		close(h->inotify);
+		h->inotify = -1;
+		return -1;
+	}
+	return h->epfd;
+}
+
+/**
+ * Process pending events for a watched task.
+ *
+ * @param h Task handle.
+ * @return 1 if the task has vanished, 0 otherwise
+ */
+int
+cg_watch_events(struct cg_handle *h)
+{
+	struct epoll_event events[64];
+	int n = (h->epfd == -1)?0:sizeof(events)/sizeof(events[0]);
+	while (n == sizeof(events)/sizeof(events[0])) {
+		if ((n = epoll_wait(h->epfd, events, n, 0)) == -1) {
+			if (errno != EINTR)
+				log_warn("cgroups", "unable to get events for task %s",
+				    h->task);
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			uint64_t idx = events[i].data.u64;
+			if (idx == UINT64_MAX) {
+				char buf[4096];
+				while (read(h->inotify, buf, sizeof(buf)) > 0);
+				continue;
+			}
+			/* A process has exited */
+			epoll_ctl(h->epfd, EPOLL_CTL_DEL, h->pidfds[idx], NULL);
+			close(h->pidfds[idx]);
+			h->pidfds[idx] = -1;
+			if (--h->alive == 0)
+				log_debug("cgroups", "all signalled processes of "
+				    "task %s have exited", h->task);
+		}
+	}
+	return !cg_valid(h);
+}
+
 /**
  * Visit each task in a namespace.
  *
@@ -374,14 +1106,12 @@ cg_iterate_tasks(const char *namespace,
     void *arg)
 {
 	int rc = -1;
-	char *path = NULL;
 	DIR *dir = NULL;
-	if (asprintf(&path, "%s/lanco-%s", CGROOT, namespace) == -1) {
-		log_warn("cgroups", "unable to allocate memory for tasks iteration");
-		goto end;
-	}
-
-	if ((dir = opendir(path)) == NULL) {
+	struct cg_handle *ns = cg_open(namespace, NULL);
+	int fd;
+	if (ns == NULL ||
+	    (fd = dup(ns->fd[CG_NAMED])) == -1 ||
+	    (dir = fdopendir(fd)) == NULL) {
 		log_warn("cgroups", "unable to open namespace directory %s",
 		    namespace);
 		goto end;
@@ -391,6 +1121,12 @@ cg_iterate_tasks(const char *namespace,
 		const char *name = dirent->d_name + strlen("task-");
 		if (dirent->d_type != DT_DIR) continue;
 		if (strncmp(dirent->d_name, "task-", strlen("task-"))) continue;
+		if (cg_unified()) {
+			int tfd = cg_opendir(dirfd(dir), dirent->d_name);
+			int populated = (tfd != -1 && cg2_is_populated(tfd));
+			if (tfd != -1) close(tfd);
+			if (!populated) continue;
+		}
 		log_debug("cgroups", "found task %s in namespace %s",
 		    name, namespace);
 		if (visit(namespace, name, arg) == -1) goto end;
@@ -399,356 +1135,978 @@ cg_iterate_tasks(const char *namespace,
 	rc = 0;
 end:
 	if (dir) closedir(dir);
-	free(path);
+	cg_close(ns);
 	return rc;
 }
 
 /**
  * Visit each PID for a task.
  *
- * @param namespace Namespace we need to find the task.
- * @param task      Task name.
+ * By default, only processes are visited (thread group leaders). When
+ * requested, each thread is visited instead.
+ *
+ * @param h         Task handle.
+ * @param threads   Visit each thread instead of each process.
  * @param visit     Function be called on each PID.
  * @param arg       Argument passed as last argument of the visitor function.
+ * @return 0 on success, -1 on error. If the task has vanished, errno is set
+ *         to ENOENT or ENODEV.
  */
 int
-cg_iterate_pids(const char *namespace, const char *task,
+cg_iterate_pids(struct cg_handle *h, int threads,
     int(*visit)(const char *namespace, const char *task, pid_t pid, void *),
     void *arg)
 {
-	int rc = -1;
-	char *path = NULL;
+	int rc = -1, error = 0;
 	FILE *tasks = NULL;
-	TAILQ_HEAD(, one_pid) pids;
-	TAILQ_INIT(&pids);
+	struct pidset pids;
+	pidset_init(&pids);
 
-	if (asprintf(&path, "%s/lanco-%s/task-%s/tasks",
-		CGROOT, namespace, task) == -1) {
-		log_warn("cgroups", "unable to allocate memory for tasks iteration");
-		goto end;
-	}
-	if ((tasks = fopen(path, "r")) == NULL) {
-		log_warn("cgroups", "unable to open tasks file %s", path);
-		goto end;
-	}
+	if ((tasks = cg_open_pids(h, threads)) == NULL)
+		goto error;
 	pid_t pid;
 	while (fscanf(tasks, "%d", &pid) == 1) {
-		int found = 0;
-		struct one_pid *new;
-		TAILQ_FOREACH(new, &pids, next) {
-			if (new->pid == pid) {
-				found = 1;
-				break;
-			}
+		switch (pidset_add(&pids, pid)) {
+		case 0: continue;
+		case -1: goto end;
 		}
-		if (found) continue;
-		if ((new = malloc(sizeof(struct one_pid))) == NULL) {
-			log_warn("cgroups", "memory allocation failure");
-			goto end;
+		if (visit(h->namespace, h->task, pid, arg) == -1) goto end;
+	}
+	if (ferror(tasks))
+		goto error;
+
+	rc = 0;
+	goto end;
+error:
+	error = errno;
+	if (error == ENOENT || error == ENODEV)
+		log_debug("cgroups", "task %s has vanished", h->task);
+	else
+		log_warn("cgroups", "unable to read PID list for task %s",
+		    h->task);
+end:
+	pidset_free(&pids);
+	if (tasks) fclose(tasks);
+	if (error) errno = error;
+	return rc;
+}
+
+/**
+ * Check if the given named hierarchy exists.
+ *
+ * @param namespace Namespace to check
+ * @return 1 if the namespace exists, 0 otherwise
+ */
+int
+cg_exist_named_hierarchy(const char *namespace)
+{
+	char *path = NULL;
+	if (asprintf(&path, "%s/lanco-%s", CGROOT, namespace) == -1) {
+		log_warn("cgroups", "unable to allocate memory for named cgroup");
+		return 0;
+	}
+	/* We only do a minimal mount check. If the hierarchy does not exist,
+	 * problems will happen later. With cgroups v2, this is just a
+	 * directory. */
+	struct stat a;
+	if (cg_unified()?
+	    (stat(path, &a) == 0 && S_ISDIR(a.st_mode)):
+	    utils_is_mount_point(path, CGROOT)) {
+		log_debug("cgroups", "%s exists", path);
+		free(path);
+		return 1;
+	}
+	log_debug("cgroups", "%s does not exist", path);
+	free(path);
+	return 0;
+}
+
+/**
+ * Delete the release agent (in /var/run)
+ *
+ * @param namespace Namespace to process
+ * @return 0 on success and -1 on error
+ */
+static int
+cg_delete_release_agent(const char *namespace)
+{
+	char *command = NULL;
+	if (asprintf(&command, RUNPREFIX "/lanco-%s/lanco-release-agent@@%s@@release",
+		namespace, namespace) == -1) {
+		log_warn("cgroups", "unable to allocate memory for release agent");
+		return -1;
+	}
+	unlink(command);
+	free(command);
+	return 0;
+}
+
+/**
+ * Delete a named hierarchy. It should be empty for this to work.
+ *
+ * @param name Name of the hierarchy.
+ * @return 0 on success and -1 on error
+ */
+static int
+cg_delete_named_hierarchy(const char *name)
+{
+	char *path = NULL;
+	if (asprintf(&path, "%s/lanco-%s", CGROOT, name) == -1) {
+		log_warn("cgroups", "unable to allocate memory for named cgroup");
+		free(path);
+		return -1;
+	}
+	if (umount(path) == -1) {
+		log_warn("cgroups",
+		    "not able to umount cgroup %s", name);
+		free(path);
+		return -1;
+	}
+	if (rmdir(path) == -1) {
+		log_warn("cgroups",
+		    "not able to remove directory %s for cgroup", path);
+		free(path);
+		return -1;
+	}
+	free(path);
+	return 0;
+}
+
+/**
+ * Delete subsystem hierarchy. It should be empty.
+ *
+ * @param subsystem Path to subsystem.
+ * @param name Name of the hierarchy.
+ * @return 0 on success and -1 on error
+ */
+static int
+cg_delete_subsystem_hierarchy(const char *subsystem, const char *name)
+{
+	char *path = NULL;
+	if (asprintf(&path, "%s/lanco-%s", subsystem, name) == -1) {
+		log_warn("cgroups", "unable to allocate memory for cgroup in %s",
+			subsystem);
+		free(path);
+		return -1;
+	}
+	if (rmdir(path) == -1) {
+		log_warn("cgroups",
+		    "not able to remove directory %s for cgroup", path);
+		free(path);
+		return -1;
+	}
+	free(path);
+	return 0;
+}
+
+/**
+ * Delete named and subsystem hierarchies. They should be empty.
+ *
+ * @param name Name of the hierarchy.
+ * @return 0 on success and -1 on error
+ */
+int
+cg_delete_hierarchies(const char *name)
+{
+	if (cg_unified())
+		return cg_delete_subsystem_hierarchy(CGROOT, name);
+	if (cg_delete_named_hierarchy(name) == -1)
+		return -1;
+	for (int i = CG_NAMED + 1; i < CG_MAX; i++) {
+		if (i == CG_CPU && cg_cpu_comounted()) continue;
+		cg_delete_subsystem_hierarchy(cg_roots[i], name);
+	}
+	cg_delete_release_agent(name);
+	return 0;
+}
+
+/**
+ * Get CPU usage for a whole namespace or just a task.
+ *
+ * The underlying file is kept open in the handle for subsequent calls.
+ *
+ * @param h Namespace or task handle.
+ * @return CPU usage or 0 if not available
+ */
+uint64_t
+cg_cpu_usage(struct cg_handle *h)
+{
+	char buf[512];
+	long long unsigned usage;
+	if (cg_unified()) {
+		/* First line of cpu.stat is "usage_usec N" */
+		if (cg_sample_property(h, CG_SAMPLE_CPU,
+			buf, sizeof(buf)) == -1)
+			return 0; /* Not available */
+		if (sscanf(buf, "usage_usec %llu", &usage) != 1) {
+			log_warnx("cgroups", "unable to parse CPU usage");
+			return 0;
+		}
+		usage *= 1000;
+		return (usage > 0)?usage:1;
+	}
+
+	if (cg_sample_property(h, CG_SAMPLE_CPU, buf, sizeof(buf)) == -1)
+		return 0; /* Not available */
+
+	char *end;
+	usage = strtoull(buf, &end, 10);
+	if (*end != '\0') {
+		log_warnx("cgroups", "unable to parse CPU usage");
+		return 0;
+	}
+	return (usage > 0)?usage:1;
+}
+
+/**
+ * Get CPU usage of each CPU for a whole namespace or just a task.
+ *
+ * This comes from cpuacct.usage_percpu and is not available with cgroups
+ * v2. The underlying file is kept open in the handle for subsequent calls.
+ *
+ * @param h     Namespace or task handle.
+ * @param usage Where to store the usage of each CPU, in nanoseconds.
+ * @param max   Maximum number of CPUs to store.
+ * @return the number of CPUs or -1 if not available
+ */
+int
+cg_cpu_percpu(struct cg_handle *h, uint64_t *usage, size_t max)
+{
+	char buf[16384];
+	if (cg_sample_property(h, CG_SAMPLE_PERCPU, buf, sizeof(buf)) == -1)
+		return -1;
+	size_t n = 0;
+	char *end;
+	for (char *start = buf; n < max; start = end) {
+		long long unsigned value = strtoull(start, &end, 10);
+		if (end == start) break;
+		usage[n++] = value;
+	}
+	return n;
+}
+
+/**
+ * Get CPU usage split between user and system for a whole namespace or
+ * just a task.
+ *
+ * With cgroups v1, this comes from cpuacct.stat, in clock ticks. With
+ * cgroups v2, this comes from cpu.stat, in microseconds. The underlying
+ * file is kept open in the handle for subsequent calls.
+ *
+ * @param h      Namespace or task handle.
+ * @param user   Where to store the time spent in user mode, in nanoseconds.
+ * @param system Where to store the time spent in kernel mode, in
+ *               nanoseconds.
+ * @return 0 on success, -1 if not available
+ */
+int
+cg_cpu_stat(struct cg_handle *h, uint64_t *user, uint64_t *system)
+{
+	int unified = cg_unified();
+	if (cg_sample_counter(h, CG_SAMPLE_CPUSTAT,
+		unified?"user_usec":"user", user) == -1 ||
+	    cg_sample_counter(h, CG_SAMPLE_CPUSTAT,
+		unified?"system_usec":"system", system) == -1)
+		return -1;
+	if (unified) {
+		*user *= 1000;
+		*system *= 1000;
+	} else {
+		static long ticks = 0;
+		if (ticks == 0 && (ticks = sysconf(_SC_CLK_TCK)) <= 0)
+			ticks = 100;
+		*user *= 1000000000ULL / ticks;
+		*system *= 1000000000ULL / ticks;
+	}
+	return 0;
+}
+
+/**
+ * Get the directory of the cpu controller: its own hierarchy if it has
+ * one, the cpu,cpuacct hierarchy otherwise.
+ */
+static int
+cg_cpu_fd(struct cg_handle *h)
+{
+	int fd = cg_fd(h, CG_CPU);
+	return (fd != -1)?fd:cg_fd(h, CG_CPUACCT);
+}
+
+/**
+ * Set a hard CPU limit for a whole namespace or just a task.
+ *
+ * The limit is enforced by the CFS bandwidth controller: the task can use
+ * a quota of CPU time for each period. With cgroups v1, this is
+ * cpu.cfs_quota_us and cpu.cfs_period_us in the cpu hierarchy. With
+ * cgroups v2, both values are written to cpu.max.
+ *
+ * @param h     Namespace or task handle.
+ * @param cores Number of CPUs the task can use.
+ * @return 0 on success and -1 on error
+ */
+int
+cg_cpu_limit(struct cg_handle *h, double cores)
+{
+	const long long period = 100000;
+	char strvalue[64];
+	int fd = cg_cpu_fd(h);
+	if (fd == -1) {
+		log_warnx("cgroups", "no CPU controller available");
+		return -1;
+	}
+	long long quota = cores * period;
+	if (quota < 1000) {
+		/* The kernel refuses a quota below 1ms */
+		log_warnx("cgroups", "CPU limit is too small");
+		return -1;
+	}
+	if (cg_unified()) {
+		snprintf(strvalue, sizeof(strvalue), "%lld %lld", quota, period);
+		return cg_write_property(fd, "cpu.max", strvalue);
+	}
+	snprintf(strvalue, sizeof(strvalue), "%lld", period);
+	if (cg_write_property(fd, "cpu.cfs_period_us", strvalue) == -1)
+		return -1;
+	snprintf(strvalue, sizeof(strvalue), "%lld", quota);
+	return cg_write_property(fd, "cpu.cfs_quota_us", strvalue);
+}
+
+/**
+ * Set the relative CPU weight for a whole namespace or just a task.
+ *
+ * The weight is expressed as cgroups v1 shares (1024 by default). With
+ * cgroups v2, it is converted to cpu.weight (100 by default).
+ *
+ * @param h      Namespace or task handle.
+ * @param shares CPU shares, between 2 and 262144.
+ * @return 0 on success and -1 on error
+ */
+int
+cg_cpu_shares(struct cg_handle *h, unsigned shares)
+{
+	char strvalue[32];
+	int fd = cg_cpu_fd(h);
+	if (fd == -1) {
+		log_warnx("cgroups", "no CPU controller available");
+		return -1;
+	}
+	if (shares < 2 || shares > 262144) {
+		log_warnx("cgroups", "CPU shares should be between 2 and 262144");
+		return -1;
+	}
+	if (cg_unified()) {
+		/* Map [2, 262144] to [1, 10000] */
+		snprintf(strvalue, sizeof(strvalue), "%u",
+		    1 + ((shares - 2) * 9999) / 262142);
+		return cg_write_property(fd, "cpu.weight", strvalue);
+	}
+	snprintf(strvalue, sizeof(strvalue), "%u", shares);
+	return cg_write_property(fd, "cpu.shares", strvalue);
+}
+
+/**
+ * Restrict a whole namespace or just a task to some CPUs and memory nodes.
+ *
+ * @param h    Namespace or task handle.
+ * @param cpus List of CPUs (like "0-3,8") or NULL to not change them.
+ * @param mems List of memory nodes or NULL to not change them.
+ * @return 0 on success and -1 on error
+ */
+int
+cg_cpuset(struct cg_handle *h, const char *cpus, const char *mems)
+{
+	int fd = cg_fd(h, CG_CPUSET);
+	if (fd == -1) {
+		log_warnx("cgroups", "no cpuset controller available");
+		return -1;
+	}
+	if (cpus && cg_write_property(fd, "cpuset.cpus", cpus) == -1)
+		return -1;
+	if (mems && cg_write_property(fd, "cpuset.mems", mems) == -1)
+		return -1;
+	return 0;
+}
+
+/**
+ * Get memory usage for a whole namespace or just a task.
+ *
+ * The underlying file is kept open in the handle for subsequent calls.
+ *
+ * @param h Namespace or task handle.
+ * @return memory usage or 0 if not available
+ */
+uint64_t
+cg_memory_usage(struct cg_handle *h)
+{
+	char buf[64];
+	if (cg_sample_property(h, CG_SAMPLE_MEMORY, buf, sizeof(buf)) == -1)
+		return 0; /* Not available */
+
+	char *end;
+	long long unsigned usage = strtoull(buf, &end, 10);
+	if (*end != '\0') {
+		log_warnx("cgroups", "unable to parse memory usage");
+		return 0;
+	}
+	return (usage > 0)?usage:1;
+}
+
+/**
+ * Fields of memory.stat we are interested in.
+ *
+ * For cgroups v1, we use the hierarchical values to also get a meaningful
+ * result for a namespace.
+ */
+static const struct {
+	const char *v1;			/* Key with cgroups v1 */
+	const char *v2;			/* Key with cgroups v2 */
+	size_t offset;			/* Offset in struct cg_memory_stat */
+} cg_memory_stat_keys[] = {
+#define CG_MEMORY_STAT_KEY(v1, v2, field) \
+	{ v1, v2, offsetof(struct cg_memory_stat, field) }
+	CG_MEMORY_STAT_KEY("total_rss",           "anon",           rss),
+	CG_MEMORY_STAT_KEY("total_cache",         "file",           cache),
+	CG_MEMORY_STAT_KEY("total_mapped_file",   "file_mapped",    mapped_file),
+	CG_MEMORY_STAT_KEY("total_swap",          NULL,             swap),
+	CG_MEMORY_STAT_KEY("total_dirty",         "file_dirty",     dirty),
+	CG_MEMORY_STAT_KEY("total_writeback",     "file_writeback", writeback),
+	CG_MEMORY_STAT_KEY("total_active_file",   "active_file",    active_file),
+	CG_MEMORY_STAT_KEY("total_inactive_file", "inactive_file",  inactive_file),
+	CG_MEMORY_STAT_KEY(NULL,                  "kernel",         kmem),
+#undef CG_MEMORY_STAT_KEY
+};
+
+/**
+ * Get a detailed memory usage for a whole namespace or just a task.
+ *
+ * memory.stat is read and parsed in a single pass. The watermark, the
+ * number of times the limit was hit and the kernel memory usage are
+ * retrieved from their own files. Fields which are not available are left
+ * to 0.
+ *
+ * @param h     Namespace or task handle.
+ * @param stat  Where to store the result.
+ * @return 0 on success, -1 if memory accounting is not available
+ */
+int
+cg_memory_stat(struct cg_handle *h, struct cg_memory_stat *stat)
+{
+	char buf[8192];
+	memset(stat, 0, sizeof(*stat));
+	if (cg_sample_property(h, CG_SAMPLE_MEMSTAT, buf, sizeof(buf)) == -1)
+		return -1;
+
+	int unified = cg_unified();
+	for (char *line = buf, *next; line != NULL; line = next) {
+		if ((next = strchr(line, '\n')) != NULL) *next++ = '\0';
+		char *value = strchr(line, ' ');
+		if (value == NULL) continue;
+		*value++ = '\0';
+		for (int i = 0;
+		     i < sizeof(cg_memory_stat_keys)/sizeof(cg_memory_stat_keys[0]);
+		     i++) {
+			const char *key = unified?
+			    cg_memory_stat_keys[i].v2:cg_memory_stat_keys[i].v1;
+			if (key == NULL || strcmp(key, line)) continue;
+			*(uint64_t *)((char *)stat + cg_memory_stat_keys[i].offset) =
+			    strtoull(value, NULL, 10);
+			break;
 		}
-		new->pid = pid;
-		TAILQ_INSERT_TAIL(&pids, new, next);
-		if (visit(namespace, task, pid, arg) == -1) goto end;
 	}
 
-	rc = 0;
-end:
-	while (!TAILQ_EMPTY(&pids)) {
-		struct one_pid *first = TAILQ_FIRST(&pids);
-		TAILQ_REMOVE(&pids, first, next);
-		free(first);
-	}
-	if (tasks) fclose(tasks);
-	free(path);
-	return rc;
+	cg_sample_counter(h, CG_SAMPLE_MEMPEAK, NULL, &stat->max_usage);
+	cg_sample_counter(h, CG_SAMPLE_MEMFAIL, unified?"max":NULL,
+	    &stat->failcnt);
+	if (unified)
+		cg_sample_counter(h, CG_SAMPLE_SWAP, NULL, &stat->swap);
+	else
+		cg_sample_counter(h, CG_SAMPLE_KMEM, NULL, &stat->kmem);
+	return 0;
 }
 
-
 /**
- * Check if the given named hierarchy exists.
+ * Set memory limit for a whole namespace or just a task.
  *
- * @param namespace Namespace to check
- * @return 1 if the namespace exists, 0 otherwise
+ * @param h     Namespace or task handle.
+ * @param limit Limit to set
+ * @return 0 on success and -1 on error
  */
 int
-cg_exist_named_hierarchy(const char *namespace)
+cg_memory_limit(struct cg_handle *h, long long unsigned limit)
 {
-	char *path = NULL;
-	if (asprintf(&path, "%s/lanco-%s", CGROOT, namespace) == -1) {
-		log_warn("cgroups", "unable to allocate memory for named cgroup");
-		return 0;
-	}
-	/* We only do a minimal mount check. If the hierarchy does not exist,
-	 * problems will happen later. */
-	if (utils_is_mount_point(path, CGROOT)) {
-		log_debug("cgroups", "%s exists", path);
-		free(path);
-		return 1;
+	char strvalue[32];
+	int fd = cg_fd(h, CG_MEMORY);
+	if (fd == -1) {
+		log_warnx("cgroups", "no memory controller available");
+		return -1;
 	}
-	log_debug("cgroups", "%s does not exist", path);
-	free(path);
-	return 0;
+	snprintf(strvalue, sizeof(strvalue), "%llu", limit);
+	return cg_write_property(fd,
+	    cg_unified()?"memory.max":"memory.limit_in_bytes", strvalue);
 }
 
 /**
- * Delete the release agent (in /var/run)
+ * Get memory limit for a whole namespace or just a task.
  *
- * @param namespace Namespace to process
- * @return 0 on success and -1 on error
+ * The underlying file is kept open in the handle for subsequent calls.
+ *
+ * @param h Namespace or task handle.
+ * @return the limit or 0 if there is no limit
+ */
+uint64_t
+cg_memory_get_limit(struct cg_handle *h)
+{
+	char buf[64];
+	if (cg_sample_property(h, CG_SAMPLE_MEMLIMIT, buf, sizeof(buf)) == -1 ||
+	    !strcmp(buf, "max"))
+		return 0;
+	long long unsigned limit = strtoull(buf, NULL, 10);
+	/* With cgroups v1, no limit is a huge value rounded to a page */
+	return (limit >= (1ULL << 62))?0:limit;
+}
+
+/**
+ * Read the OOM counter of a task from memory.events (cgroups v2 only).
+ *
+ * The notification file descriptor is read again to rearm notifications.
+ *
+ * @param h     Task handle.
+ * @param count Where to store the counter.
+ * @return 0 on success, -1 on error
  */
 static int
-cg_delete_release_agent(const char *namespace)
+cg2_oom_count(struct cg_handle *h, uint64_t *count)
 {
-	char *command = NULL;
-	if (asprintf(&command, RUNPREFIX "/lanco-%s/lanco-release-agent@@%s@@release",
-		namespace, namespace) == -1) {
-		log_warn("cgroups", "unable to allocate memory for release agent");
+	char buf[512];
+	ssize_t n = pread(h->notify[CG_MEMORY_OOM], buf, sizeof(buf) - 1, 0);
+	if (cg_terminate_property(buf, n) == -1) {
+		log_warn("cgroups", "unable to read memory.events for task %s",
+		    h->task);
 		return -1;
 	}
-	unlink(command);
-	free(command);
+	char *oom = strstr(buf, "\noom ");
+	*count = oom?strtoull(oom + strlen("\noom "), NULL, 10):0;
 	return 0;
 }
 
 /**
- * Delete a named hierarchy. It should be empty for this to work.
+ * Get the state of the OOM killer for a whole namespace or just a task.
  *
- * @param name Name of the hierarchy.
- * @return 0 on success and -1 on error
+ * With cgroups v1, this is memory.oom_control. With cgroups v2, OOM
+ * situations and kills are counted in memory.events and the OOM killer
+ * cannot be disabled. The file is kept open in the handle for subsequent
+ * calls.
+ *
+ * @param h   Namespace or task handle.
+ * @param oom Where to store the result.
+ * @return 0 on success, -1 if memory accounting is not available
  */
-static int
-cg_delete_named_hierarchy(const char *name)
+int
+cg_memory_oom(struct cg_handle *h, struct cg_memory_oom *oom)
 {
-	char *path = NULL;
-	if (asprintf(&path, "%s/lanco-%s", CGROOT, name) == -1) {
-		log_warn("cgroups", "unable to allocate memory for named cgroup");
-		free(path);
-		return -1;
-	}
-	if (umount(path) == -1) {
-		log_warn("cgroups",
-		    "not able to umount cgroup %s", name);
-		free(path);
-		return -1;
-	}
-	if (rmdir(path) == -1) {
-		log_warn("cgroups",
-		    "not able to remove directory %s for cgroup", path);
-		free(path);
+	char buf[512];
+	memset(oom, 0, sizeof(*oom));
+	if (cg_sample_property(h, CG_SAMPLE_OOM, buf, sizeof(buf)) == -1)
 		return -1;
+	for (char *line = buf, *next; line != NULL; line = next) {
+		if ((next = strchr(line, '\n')) != NULL) *next++ = '\0';
+		char *value = strchr(line, ' ');
+		if (value == NULL) continue;
+		*value++ = '\0';
+		uint64_t v = strtoull(value, NULL, 10);
+		if (!strcmp(line, "oom_kill_disable")) oom->disabled = v;
+		else if (!strcmp(line, "under_oom")) oom->under_oom = v;
+		else if (!strcmp(line, "oom")) oom->oom = v;
+		else if (!strcmp(line, "oom_kill")) oom->oom_kill = v;
 	}
-	free(path);
 	return 0;
 }
 
 /**
- * Delete subsystem hierarchy. It should be empty.
+ * Disable or enable the kernel OOM killer for a task.
  *
- * @param subsystem Path to subsystem.
- * @param name Name of the hierarchy.
+ * When disabled, the processes of the task hitting the memory limit are
+ * paused until some memory is freed. This is only possible with cgroups
+ * v1.
+ *
+ * @param h       Task handle.
+ * @param disable 1 to disable the OOM killer, 0 to enable it.
  * @return 0 on success and -1 on error
  */
-static int
-cg_delete_subsystem_hierarchy(const char *subsystem, const char *name)
+int
+cg_memory_oom_disable(struct cg_handle *h, int disable)
 {
-	char *path = NULL;
-	if (asprintf(&path, "%s/lanco-%s", subsystem, name) == -1) {
-		log_warn("cgroups", "unable to allocate memory for cgroup in %s",
-			subsystem);
-		free(path);
+	int fd = cg_fd(h, CG_MEMORY);
+	if (fd == -1) {
+		log_warnx("cgroups", "no memory controller available");
 		return -1;
 	}
-	if (rmdir(path) == -1) {
-		log_warn("cgroups",
-		    "not able to remove directory %s for cgroup", path);
-		free(path);
+	if (cg_unified()) {
+		log_warnx("cgroups", "OOM killer cannot be disabled with cgroups v2");
 		return -1;
 	}
-	free(path);
-	return 0;
+	return cg_write_property(fd, "memory.oom_control", disable?"1":"0");
 }
 
 /**
- * Delete named and subsystem hierarchies. They should be empty.
+ * Pressure Stall Information triggers used with cgroups v2 for each
+ * pressure level: kind of stall, stall time and window, in microseconds.
+ * Unprivileged users can only use windows which are a multiple of 2
+ * seconds.
+ */
+static const char *cg2_pressure_triggers[CG_MEMORY_EVENT_MAX] = {
+	[CG_MEMORY_LOW]      = "some 100000 2000000",
+	[CG_MEMORY_MEDIUM]   = "some 300000 2000000",
+	[CG_MEMORY_CRITICAL] = "full 200000 2000000",
+};
+
+/**
+ * Register a memory notification for a task.
  *
- * @param name Name of the hierarchy.
- * @return 0 on success and -1 on error
+ * With cgroups v1, an eventfd is registered through cgroup.event_control
+ * on memory.pressure_level, on memory.usage_in_bytes for a threshold or on
+ * memory.oom_control. With cgroups v2, a PSI trigger is written to
+ * memory.pressure and OOM are detected through changes of memory.events.
+ * Usage thresholds are not available with cgroups v2.
+ *
+ * The returned file descriptor is owned by the handle. It should be polled
+ * for the events stored in `events` (EPOLLIN for an eventfd, EPOLLPRI for
+ * PSI triggers and memory.events). cg_memory_notified() should then be
+ * called with the events received.
+ *
+ * @param h         Task handle.
+ * @param event     Event to be notified of.
+ * @param threshold Memory usage threshold for CG_MEMORY_THRESHOLD.
+ * @param events    Where to store the events to poll for.
+ * @return a file descriptor or -1 on error
  */
 int
-cg_delete_hierarchies(const char *name)
+cg_memory_notify(struct cg_handle *h, enum cg_memory_event event,
+    uint64_t threshold, uint32_t *events)
 {
-	if (cg_delete_named_hierarchy(name) == -1)
+	static const char *levels[CG_MEMORY_EVENT_MAX] = {
+		[CG_MEMORY_LOW]      = "low",
+		[CG_MEMORY_MEDIUM]   = "medium",
+		[CG_MEMORY_CRITICAL] = "critical",
+	};
+	int dirfd = cg_fd(h, CG_MEMORY);
+	if (dirfd == -1) {
+		log_debug("cgroups", "no memory controller for task %s", h->task);
 		return -1;
-	cg_delete_subsystem_hierarchy(CGCPUACCT, name);
-	cg_delete_subsystem_hierarchy(CGMEMORY, name);
-	cg_delete_release_agent(name);
-	return 0;
+	}
+	if (cg_unified())
+		/* PSI triggers and memory.events are always readable, only
+		 * POLLPRI is meaningful */
+		*events = EPOLLPRI;
+	else
+		*events = EPOLLIN;
+	if (h->notify[event] != -1) return h->notify[event];
+
+	if (cg_unified() && event == CG_MEMORY_OOM) {
+		/* memory.events is modified on OOM, this is notified with
+		 * POLLPRI. It needs to be read again to rearm the
+		 * notification. */
+		int fd = openat(dirfd, "memory.events", O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			log_warn("cgroups", "unable to open memory.events for "
+			    "task %s", h->task);
+			return -1;
+		}
+		h->notify[event] = fd;
+		cg2_oom_count(h, &h->oom);
+		return fd;
+	}
+	if (cg_unified()) {
+		const char *trigger = cg2_pressure_triggers[event];
+		if (trigger == NULL) {
+			log_debug("cgroups", "memory thresholds are not "
+			    "available with cgroups v2");
+			return -1;
+		}
+		int fd = openat(dirfd, "memory.pressure",
+		    O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (fd == -1 ||
+		    write(fd, trigger, strlen(trigger) + 1) == -1) {
+			log_warn("cgroups", "unable to set pressure trigger for "
+			    "task %s", h->task);
+			if (fd != -1) close(fd);
+			return -1;
+		}
+		return (h->notify[event] = fd);
+	}
+
+	const char *property = (event == CG_MEMORY_THRESHOLD)?
+	    "memory.usage_in_bytes":
+	    (event == CG_MEMORY_OOM)?"memory.oom_control":
+	    "memory.pressure_level";
+	char args[64];
+	if (event == CG_MEMORY_THRESHOLD)
+		snprintf(args, sizeof(args), " %" PRIu64, threshold);
+	else if (event == CG_MEMORY_OOM)
+		args[0] = '\0';
+	else
+		snprintf(args, sizeof(args), " %s", levels[event]);
+
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int cfd = openat(dirfd, property, O_RDONLY | O_CLOEXEC);
+	if (efd == -1 || cfd == -1) {
+		log_warn("cgroups", "unable to open %s for task %s",
+		    property, h->task);
+		goto error;
+	}
+	char control[128];
+	snprintf(control, sizeof(control), "%d %d%s", efd, cfd, args);
+	if (cg_write_property(dirfd, "cgroup.event_control", control) == -1)
+		goto error;
+	close(cfd);
+	return (h->notify[event] = efd);
+
+error:
+	if (efd != -1) close(efd);
+	if (cfd != -1) close(cfd);
+	return -1;
 }
 
 /**
- * Get a property of a given cgroup.
- * @param controller Controller to use or NULL for none
- * @param namespace  Namespace to process
- * @param task       Task name or NULL if not task
- * @param property   Property to get.
- * @return a string with the property or NULL on error
+ * Acknowledge a memory notification for a task.
+ *
+ * With cgroups v1, all notifications are also signaled when the memory
+ * cgroup is removed. This is not counted as an event.
  *
- * The string should be freed after usage.
+ * @param h      Task handle.
+ * @param event  Event which has been notified.
+ * @param events Events returned by epoll for the file descriptor.
+ * @return the number of occurrences of the event (may be 0), -1 on error or
+ *         if the memory cgroup of the task has been removed
  */
-static char *
-cg_get_property(const char *controller, const char *namespace,
-    const char *task, const char *property)
+int
+cg_memory_notified(struct cg_handle *h, enum cg_memory_event event,
+    uint32_t events)
 {
-	char *path = NULL;
-	if (asprintf(&path, "%s/%s/lanco-%s/%s%s/%s", CGROOT, controller?controller:"",
-		namespace, task?"task-":"", task?task:"", property) == -1) {
-		log_warn("cgroups", "unable to allocate memory to get property");
-		return NULL;
-	}
-
-	FILE *fproperty = fopen(path, "r");
-	if (fproperty == NULL) {
-		log_debug("cgroups", "unable to open %s", path);
-		free(path);
-		return NULL;
+	if (h->notify[event] == -1) return -1;
+	if (cg_unified() && event == CG_MEMORY_OOM) {
+		if (!(events & EPOLLPRI)) return 0;
+		uint64_t previous = h->oom;
+		if (cg2_oom_count(h, &h->oom) == -1) return -1;
+		return h->oom - previous;
 	}
-	char *result = NULL; size_t n;
-	if (getline(&result, &n, fproperty) == -1) {
-		log_warn("cgroups", "unable to read property from %s", path);
-		free(path);
-		return NULL;
+	if (cg_unified()) {
+		/* The trigger is reset by polling. POLLERR is signaled when
+		 * the cgroup is removed. */
+		if (events & EPOLLERR) return -1;
+		return (events & EPOLLPRI)?1:0;
 	}
-	free(path);
-	if (strlen(result) == 0) {
-		free(result);
-		return NULL;
+
+	uint64_t count;
+	if (read(h->notify[event], &count, sizeof(count)) != sizeof(count)) {
+		if (errno == EAGAIN) return 0;
+		log_warn("cgroups", "unable to read memory notification for "
+		    "task %s", h->task);
+		return -1;
 	}
-	if (result[strlen(result) - 1] == '\n')
-		result[strlen(result) - 1] = '\0';
-	if (strlen(result) == 0) {
-		free(result);
-		return NULL;
+	if (faccessat(h->fd[CG_MEMORY], "cgroup.procs", F_OK, 0) == -1) {
+		log_debug("cgroups", "memory cgroup for task %s has been removed",
+		    h->task);
+		return -1;
 	}
-	return result;
+	return count;
 }
 
 /**
- * Get CPU usage for a whole namespace or just a task.
+ * Sum the read and write counters of a blkio file (cgroups v1 only).
  *
- * @param namespace  Namespace to process
- * @param task       Task name or NULL if not task
- * @return CPU usage or 0 if not available
+ * Each line is "MAJOR:MINOR Operation value". The last line is the total of
+ * all operations and devices.
+ *
+ * @param h      Task handle.
+ * @param sample Property to sample.
+ * @param read   Where to store the sum of reads.
+ * @param write  Where to store the sum of writes.
+ * @return 0 on success, -1 if not available
  */
-uint64_t
-cg_cpu_usage(const char *namespace, const char *task)
+static int
+cg1_io_counters(struct cg_handle *h, enum cg_sample sample,
+    uint64_t *read, uint64_t *write)
 {
-	char *usagestr = cg_get_property("cpuacct", namespace, task,
-	    "cpuacct.usage");
-	if (usagestr == NULL) return 0; /* Not available */
-
-	char *end;
-	long long unsigned usage = strtoll(usagestr, &end, 10);
-	if (*end != '\0') {
-		log_warnx("cgroups", "unable to parse CPU usage");
-		free(usagestr);
-		return 0;
+	char buf[16384];
+	if (cg_sample_property(h, sample, buf, sizeof(buf)) == -1)
+		return -1;
+	for (char *line = buf, *next; line != NULL; line = next) {
+		char op[16];
+		long long unsigned value;
+		if ((next = strchr(line, '\n')) != NULL) *next++ = '\0';
+		if (sscanf(line, "%*u:%*u %15s %llu", op, &value) != 2)
+			continue;
+		if (!strcmp(op, "Read")) *read += value;
+		else if (!strcmp(op, "Write")) *write += value;
 	}
-	free(usagestr);
-	return (usage > 0)?usage:1;
+	return 0;
 }
 
 /**
- * Get memory usage for a whole namespace or just a task.
+ * Get block I/O usage for a task.
  *
- * @param namespace  Namespace to process
- * @param task       Task name or NULL if not task
- * @return memory usage or 0 if not available
+ * With cgroups v1, this comes from blkio.throttle.io_service_bytes and
+ * blkio.throttle.io_serviced. With cgroups v2, this comes from io.stat.
+ * Counters of all devices are summed. The underlying files are kept open in
+ * the handle for subsequent calls.
+ *
+ * @param h    Task handle.
+ * @param stat Where to store the result.
+ * @return 0 on success, -1 if I/O accounting is not available
  */
-uint64_t
-cg_memory_usage(const char *namespace, const char *task)
+int
+cg_io_stat(struct cg_handle *h, struct cg_io_stat *stat)
 {
-	char *usagestr = cg_get_property("memory", namespace, task,
-	    "memory.usage_in_bytes");
-	if (usagestr == NULL) return 0; /* Not available */
-
-	char *end;
-	long long unsigned usage = strtoll(usagestr, &end, 10);
-	if (*end != '\0') {
-		log_warnx("cgroups", "unable to parse memory usage");
-		free(usagestr);
-		return 0;
+	memset(stat, 0, sizeof(*stat));
+	if (!cg_unified())
+		return (cg1_io_counters(h, CG_SAMPLE_IOBYTES,
+			&stat->read_bytes, &stat->write_bytes) == -1 ||
+		    cg1_io_counters(h, CG_SAMPLE_IOS,
+			&stat->read_ios, &stat->write_ios) == -1)?-1:0;
+
+	char buf[16384];
+	if (cg_sample_property(h, CG_SAMPLE_IOBYTES, buf, sizeof(buf)) == -1)
+		return -1;
+	/* Each line is "MAJOR:MINOR key=value key=value..." */
+	for (char *word = strtok(buf, " \n"); word; word = strtok(NULL, " \n")) {
+		char *value = strchr(word, '=');
+		if (value == NULL) continue;
+		*value++ = '\0';
+		uint64_t v = strtoull(value, NULL, 10);
+		if (!strcmp(word, "rbytes")) stat->read_bytes += v;
+		else if (!strcmp(word, "wbytes")) stat->write_bytes += v;
+		else if (!strcmp(word, "rios")) stat->read_ios += v;
+		else if (!strcmp(word, "wios")) stat->write_ios += v;
 	}
-	free(usagestr);
-	return (usage > 0)?usage:1;
+	return 0;
 }
 
 /**
- * Set a property of a given cgroup.
+ * Set the relative block I/O weight for a task.
  *
- * @param path     Path to cgroup.
- * @param property Property to change.
- * @param value    Value to set.
- * @return 0 on success and -1 on error
+ * With cgroups v1, the weight is between 10 and 1000 and is written to
+ * blkio.weight (or blkio.bfq.weight with BFQ). With cgroups v2, it is
+ * between 1 and 10000 and is written to io.weight (or io.bfq.weight). The
+ * weight is only honored by some I/O schedulers.
  *
- * This is really `echo value > path/property`.
+ * @param h      Task handle.
+ * @param weight Weight to set.
+ * @return 0 on success and -1 on error
  */
-static int
-cg_set_property(const char *path, const char *property, const char *value)
+int
+cg_io_weight(struct cg_handle *h, unsigned weight)
 {
-	log_debug("cgroups", "setting property %s=%s in %s",
-	    property, value, path);
-	char *fpath = NULL;
-	if (asprintf(&fpath, "%s/%s", path, property) == -1) {
-		log_warn("cgroups", "unable to allocate memory to set property");
+	char strvalue[32];
+	int fd = cg_fd(h, CG_BLKIO);
+	if (fd == -1) {
+		log_warnx("cgroups", "no block I/O controller available");
 		return -1;
 	}
+	const char *property = cg_unified()?"io.weight":"blkio.weight";
+	const char *bfq = cg_unified()?"io.bfq.weight":"blkio.bfq.weight";
+	if (faccessat(fd, property, F_OK, 0) == -1) property = bfq;
+	snprintf(strvalue, sizeof(strvalue), cg_unified()?"default %u":"%u",
+	    weight);
+	return cg_write_property(fd, property, strvalue);
+}
 
-	FILE *fproperty = fopen(fpath, "w");
-	if (fproperty == NULL) {
-		log_warn("cgroups", "unable to open %s", fpath);
-		free(fpath);
+/**
+ * Throttle block I/O for a task on a given device.
+ *
+ * With cgroups v1, this is one of the blkio.throttle.*_device files. With
+ * cgroups v2, this is a key of io.max.
+ *
+ * @param h      Task handle.
+ * @param limit  What to limit.
+ * @param device Device to throttle.
+ * @param value  Maximum number of bytes or operations per second.
+ * @return 0 on success and -1 on error
+ */
+int
+cg_io_limit(struct cg_handle *h, enum cg_io_limit limit, dev_t device,
+    uint64_t value)
+{
+	static const struct {
+		const char *v1;		/* File with cgroups v1 */
+		const char *v2;		/* Key in io.max with cgroups v2 */
+	} limits[CG_IO_LIMIT_MAX] = {
+		[CG_IO_READ_BPS]   = { "blkio.throttle.read_bps_device", "rbps" },
+		[CG_IO_WRITE_BPS]  = { "blkio.throttle.write_bps_device", "wbps" },
+		[CG_IO_READ_IOPS]  = { "blkio.throttle.read_iops_device", "riops" },
+		[CG_IO_WRITE_IOPS] = { "blkio.throttle.write_iops_device", "wiops" },
+	};
+	char strvalue[128];
+	int fd = cg_fd(h, CG_BLKIO);
+	if (fd == -1) {
+		log_warnx("cgroups", "no block I/O controller available");
 		return -1;
 	}
-	if (fprintf(fproperty, "%s", value) < 0) {
-		log_warn("cgroups", "unable to write to %s", fpath);
-		fclose(fproperty);
-		free(fpath);
-		return -1;
+	if (cg_unified()) {
+		snprintf(strvalue, sizeof(strvalue), "%u:%u %s=%" PRIu64,
+		    major(device), minor(device), limits[limit].v2, value);
+		return cg_write_property(fd, "io.max", strvalue);
 	}
-	free(fpath);
-	fclose(fproperty);
+	snprintf(strvalue, sizeof(strvalue), "%u:%u %" PRIu64,
+	    major(device), minor(device), value);
+	return cg_write_property(fd, limits[limit].v1, strvalue);
+}
+
+/**
+ * Get the number of tasks (processes and threads) in a whole namespace or
+ * just a task from the pids controller.
+ *
+ * This is much cheaper than walking the list of processes. The underlying
+ * file is kept open in the handle for subsequent calls.
+ *
+ * @param h     Namespace or task handle.
+ * @param count Where to store the number of tasks.
+ * @return 0 on success, -1 if the pids controller is not available
+ */
+int
+cg_pids_current(struct cg_handle *h, uint64_t *count)
+{
+	return cg_sample_counter(h, CG_SAMPLE_PIDS, NULL, count);
+}
+
+/**
+ * Get the maximum number of tasks (processes and threads) for a whole
+ * namespace or just a task.
+ *
+ * @param h   Namespace or task handle.
+ * @param max Where to store the limit, 0 if there is no limit.
+ * @return 0 on success, -1 if the pids controller is not available
+ */
+int
+cg_pids_get_max(struct cg_handle *h, uint64_t *max)
+{
+	char buf[64];
+	if (cg_read_property(cg_fd(h, CG_PIDS), "pids.max",
+		buf, sizeof(buf)) == -1)
+		return -1;
+	*max = strcmp(buf, "max")?strtoull(buf, NULL, 10):0;
 	return 0;
 }
 
 /**
- * Set memory limit for a whole namespace or just a task.
+ * Limit the number of tasks (processes and threads) for a whole namespace
+ * or just a task. Once the limit is reached, fork() and clone() fail.
  *
- * @param namespace Namespace to process
- * @param task      Task name or NULL if not task
- * @param limit     Limit to set
+ * @param h   Namespace or task handle.
+ * @param max Maximum number of tasks.
  * @return 0 on success and -1 on error
  */
 int
-cg_memory_limit(const char *namespace, const char *task,
-    long long unsigned limit)
+cg_pids_max(struct cg_handle *h, uint64_t max)
 {
-	char *strvalue = NULL;
-	if (asprintf(&strvalue, "%llu", limit) == -1) {
-		log_warn("cgroups", "unable to allocate memory for memory limit");
-		return -1;
-	}
-	char *path = NULL;
-	if (asprintf(&path, "%s/lanco-%s/%s%s", CGMEMORY,
-		namespace, task?"task-":"", task?task:"") == -1) {
-		log_warn("cgroups", "unable to allocate memory to set property");
-		free(strvalue);
+	char strvalue[32];
+	int fd = cg_fd(h, CG_PIDS);
+	if (fd == -1) {
+		log_warnx("cgroups", "no pids controller available");
 		return -1;
 	}
-
-	int ret = cg_set_property(path, "memory.limit_in_bytes", strvalue);
-	free(strvalue);
-	free(path);
-	return ret;
+	snprintf(strvalue, sizeof(strvalue), "%" PRIu64, max);
+	return cg_write_property(fd, "pids.max", strvalue);
 }
 
 /**
@@ -1027,6 +2385,113 @@ cg_setup_optional_hierarchy(const char *name,
 		return;
 }
 
+/**
+ * Setup the namespace in the cpuset hierarchy.
+ *
+ * A new cpuset cgroup has no CPU and no memory node: nobody can be attached
+ * to it. The namespace gets the ones of the root cgroup and
+ * cgroup.clone_children is enabled to let new tasks inherit them.
+ *
+ * @param namespace Namespace.
+ */
+static void
+cg_setup_cpuset(const char *namespace)
+{
+	static const char *properties[] = { "cpuset.cpus", "cpuset.mems", NULL };
+	char name[NAME_MAX + 1];
+	char value[4096];
+	snprintf(name, sizeof(name), "lanco-%s", namespace);
+	int root = open(CGCPUSET, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int nsfd = cg_opendir(root, name);
+	if (nsfd == -1) {
+		log_debug("cgroups", "no cpuset hierarchy for %s", namespace);
+		goto end;
+	}
+	for (const char **p = properties; *p; p++) {
+		if (cg_read_property(nsfd, *p, value, sizeof(value)) != -1)
+			continue; /* Already set */
+		if (cg_read_property(root, *p, value, sizeof(value)) == -1 ||
+		    cg_write_property(nsfd, *p, value) == -1) {
+			log_warnx("cgroups", "unable to setup %s for %s",
+			    *p, namespace);
+			goto end;
+		}
+	}
+	if (cg_write_property(nsfd, "cgroup.clone_children", "1") == -1)
+		log_warnx("cgroups", "unable to setup cpuset inheritance for %s",
+		    namespace);
+end:
+	if (nsfd != -1) close(nsfd);
+	if (root != -1) close(root);
+}
+
+/**
+ * Enable a controller for the children of a cgroup (cgroups v2 only).
+ *
+ * @param path       Path to cgroup.
+ * @param controller Controller to enable.
+ *
+ * Not being able to enable a controller is not an error. The corresponding
+ * accounting won't be available.
+ */
+static void
+cg2_enable_controller(const char *path, const char *controller)
+{
+	char *value = NULL;
+	if (asprintf(&value, "+%s", controller) == -1) {
+		log_warn("cgroups", "unable to allocate memory for controller");
+		return;
+	}
+	if (cg_set_property(path, "cgroup.subtree_control", value) == -1)
+		log_info("cgroups", "unable to enable %s controller in %s",
+		    controller, path);
+	free(value);
+}
+
+/**
+ * Setup the unified hierarchy (cgroups v2).
+ *
+ * The namespace is a directory at the root of the unified hierarchy.
+ * Moving a process into one of its tasks requires write access to the
+ * common ancestor of the source and destination cgroups, which is the
+ * root. Therefore, the namespace cannot be delegated to an unprivileged
+ * user or group. Controllers are enabled on the way.
+ *
+ * @param namespace Namespace to create.
+ * @param uid UID of the user owning the namespace.
+ * @param gid GID of the group owning the namespace.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int
+cg2_setup_hierarchy(const char *namespace, uid_t uid, gid_t gid)
+{
+	static const char *controllers[] = { "cpu", "memory", "cpuset", "io",
+					     "pids", NULL };
+
+	if ((uid != (uid_t)-1 && uid != 0) ||
+	    (gid != (gid_t)-1 && gid != 0)) {
+		log_warnx("cgroups", "with cgroups v2, namespace %s can only "
+		    "be used by root, do not provide a user or a group",
+		    namespace);
+		return -1;
+	}
+	for (const char **c = controllers; *c; c++)
+		cg2_enable_controller(CGROOT, *c);
+	if (cg_setup_subsystem_hierarchy(CGROOT, namespace, uid, gid) == -1)
+		return -1;
+
+	char *path = NULL;
+	if (asprintf(&path, "%s/lanco-%s", CGROOT, namespace) == -1) {
+		log_warn("cgroups", "unable to allocate memory for cgroup");
+		return -1;
+	}
+	for (const char **c = controllers; *c; c++)
+		cg2_enable_controller(path, *c);
+	free(path);
+	return 0;
+}
+
 /**
  * Setup cgroups hierarchy.
  *
@@ -1037,6 +2502,8 @@ cg_setup_optional_hierarchy(const char *name,
  * @param uid UID of the user owning the named hierarchy.
  * @param gid GID of the group owning the named hierarchy.
  *
+ * With cgroups v2, the namespace is just a directory in the unified hierarchy.
+ *
  * Use -1 for UID or GID to not change the owner.
  *
  * @return 0 on success, -1 otherwise
@@ -1044,6 +2511,9 @@ cg_setup_optional_hierarchy(const char *name,
 int
 cg_setup_hierarchies(const char *namespace, uid_t uid, gid_t gid)
 {
+	if (cg_unified())
+		return cg2_setup_hierarchy(namespace, uid, gid);
+
 	if (!utils_is_mount_point(CGROOT, CGROOTPARENT)) {
 		if (!utils_is_empty_dir(CGROOT)) {
 			log_warnx("cgroups",
@@ -1067,12 +2537,33 @@ cg_setup_hierarchies(const char *namespace, uid_t uid, gid_t gid)
 	if (cg_setup_named_hierarchy(namespace, uid, gid) == -1)
 		return -1;
 
-	cg_setup_optional_hierarchy("cpu,cpuacct",
-	    CGCPUCPUACCT, CGCPUACCT,
-	    namespace, uid, gid);
+	if (utils_is_mount_point(CGCPU, CGROOT) &&
+	    utils_is_mount_point(CGCPUACCT, CGROOT) &&
+	    !cg_cpu_comounted()) {
+		/* cpu and cpuacct are in distinct hierarchies */
+		cg_setup_optional_hierarchy("cpuacct",
+		    CGCPUACCT, NULL,
+		    namespace, uid, gid);
+		cg_setup_optional_hierarchy("cpu",
+		    CGCPU, NULL,
+		    namespace, uid, gid);
+	} else
+		cg_setup_optional_hierarchy("cpu,cpuacct",
+		    CGCPUCPUACCT, CGCPUACCT,
+		    namespace, uid, gid);
 	cg_setup_optional_hierarchy("memory",
 	    CGMEMORY, NULL,
 	    namespace, uid, gid);
+	cg_setup_optional_hierarchy("cpuset",
+	    CGCPUSET, NULL,
+	    namespace, uid, gid);
+	cg_setup_cpuset(namespace);
+	cg_setup_optional_hierarchy("blkio",
+	    CGBLKIO, NULL,
+	    namespace, uid, gid);
+	cg_setup_optional_hierarchy("pids",
+	    CGPIDS, NULL,
+	    namespace, uid, gid);
 
 	return 0;
 }
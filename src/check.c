@@ -60,7 +60,7 @@ cmd_check(const char *namespace, int argc, char * const argv[])
 		log_warnx("check", "task should be an alphanumeric ASCII string");
 		return -1;
 	}
-	if (!cg_exist_task(namespace, task, NULL)) {
+	if (!cg_exist_task(namespace, task)) {
 		log_info("check", "task %s is not running", task);
 		return -1;
 	}
@@ -19,8 +19,13 @@
 
 #include <getopt.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
 #include <time.h>
-#include <jansson.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 extern const char *__progname;
 
@@ -31,97 +36,511 @@ usage(void)
 		__progname);
 	fprintf(stderr, "Version: %s\n", PACKAGE_STRING);
 	fprintf(stderr, "\n");
+	fprintf(stderr, "-t         list threads instead of processes.\n");
+	fprintf(stderr, "-w secs    dump every secs seconds, one JSON document per line.\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "see manual page lanco(8) for more information\n");
 }
 
 
+/* State of a task kept between two dumps in watch mode */
+struct task_sample {
+	char *name;		/* Task name */
+	struct cg_handle *h;	/* Handle to the task, kept open */
+	uint64_t ts;		/* Time of the sample in nanoseconds */
+	uint64_t cpu;		/* CPU usage */
+	uint64_t memory;	/* Memory usage */
+	struct pidset pids;	/* Processes (or threads) */
+};
+
+/* Samples of all tasks, sorted by name once complete */
+struct samples {
+	struct task_sample *tasks; /* Samples */
+	size_t count;		/* Number of samples */
+	size_t size;		/* Allocated size of tasks */
+};
+
+struct dump_args {
+	struct json *json;	/* Output */
+	int count;		/* Number of tasks or processes dumped */
+	int threads;		/* List threads instead of processes */
+	int nbcpus;		/* Number of CPUs */
+	struct samples *previous; /* Previous samples or NULL */
+	struct samples *current;  /* Current samples or NULL if not watching */
+	int matched;		/* Number of tasks found in previous samples */
+	struct pidset *pids;	/* Processes of the current task */
+	struct pidset *old_pids;  /* Previous processes of the current task */
+	int started;		/* New processes in the current task */
+};
+
 static int
-one_pid(const char *namespace, const char *name, pid_t pid, void *arg)
+sample_compare(const void *a, const void *b)
 {
-	json_t *pids = arg;
-	const char *command = utils_cmdline(pid);
-
-	/* Append the new PID */
-	if (json_array_append_new(pids, json_pack("{s:i,s:o}",
-		    "pid", pid,
-		    "cmdline", command?json_string(command):json_null())) == -1) {
-		log_warnx("dump", "unable to record PID %d for task %s",
-		    pid, name);
-		return -1;
+	const struct task_sample *s1 = a, *s2 = b;
+	return strcmp(s1->name, s2->name);
+}
+
+/* Find the previous sample of a task */
+static struct task_sample *
+samples_find(struct samples *samples, const char *name)
+{
+	struct task_sample key = { .name = (char *)name };
+	if (samples == NULL || samples->count == 0) return NULL;
+	return bsearch(&key, samples->tasks, samples->count,
+	    sizeof(struct task_sample), sample_compare);
+}
+
+/* Append a new sample, NULL on error */
+static struct task_sample *
+samples_add(struct samples *samples, const char *name)
+{
+	if (samples->count >= samples->size) {
+		size_t size = samples->size?(samples->size * 2):64;
+		struct task_sample *tasks = realloc(samples->tasks,
+		    size * sizeof(struct task_sample));
+		if (tasks == NULL) {
+			log_warn("dump", "unable to allocate memory for samples");
+			return NULL;
+		}
+		samples->tasks = tasks;
+		samples->size = size;
 	}
+	struct task_sample *sample = &samples->tasks[samples->count];
+	memset(sample, 0, sizeof(*sample));
+	if ((sample->name = strdup(name)) == NULL) {
+		log_warn("dump", "unable to allocate memory for samples");
+		return NULL;
+	}
+	pidset_init(&sample->pids);
+	samples->count++;
+	return sample;
+}
+
+static void
+samples_free(struct samples *samples)
+{
+	for (size_t i = 0; i < samples->count; i++) {
+		free(samples->tasks[i].name);
+		if (samples->tasks[i].h) cg_close(samples->tasks[i].h);
+		pidset_free(&samples->tasks[i].pids);
+	}
+	samples->count = 0;
+}
+
+static uint64_t
+dump_now(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
+static int
+one_pid(const char *namespace, const char *name, pid_t pid, void *arg)
+{
+	struct dump_args *args = arg;
+	struct json *json = args->json;
+	if (args->pids) {
+		if (pidset_add(args->pids, pid) == -1) return -1;
+		if (args->old_pids && !pidset_contains(args->old_pids, pid))
+			args->started++;
+	}
+	json_object_start(json);
+	json_key(json, "pid");
+	json_integer(json, pid);
+	json_key(json, "cmdline");
+	json_string(json, utils_cmdline(pid));
+	json_object_end(json);
+	args->count++;
 	return 0;
 }
 
+/**
+ * Write detailed CPU usage in the current JSON object: usage of each CPU
+ * and split between user and system.
+ */
+static void
+dump_cpu_detail(struct cg_handle *h, struct json *json)
+{
+	static int max = 0;
+	static uint64_t *usage = NULL;
+	if (max == 0) {
+		max = sysconf(_SC_NPROCESSORS_CONF);
+		if (max <= 0) max = 1;
+		if ((usage = calloc(max, sizeof(uint64_t))) == NULL) max = -1;
+	}
+	int n = (max > 0)?cg_cpu_percpu(h, usage, max):-1;
+	if (n > 0) {
+		json_key(json, "cpu_percpu");
+		json_array_start(json);
+		for (int i = 0; i < n; i++)
+			json_integer(json, usage[i]);
+		json_array_end(json);
+	}
+	uint64_t user, system;
+	if (cg_cpu_stat(h, &user, &system) == 0) {
+		json_key(json, "cpu_user");
+		json_integer(json, user);
+		json_key(json, "cpu_system");
+		json_integer(json, system);
+	}
+}
+
+/* Write an integer member in the current JSON object */
+static void
+dump_integer(struct json *json, const char *key, int64_t value)
+{
+	json_key(json, key);
+	json_integer(json, value);
+}
+
+/**
+ * Write a task. Processes are written while they are iterated and the
+ * output is flushed after each task: memory usage does not depend on
+ * the number of tasks or processes.
+ */
 static int
 one_task(const char *namespace, const char *name, void *arg)
 {
-	json_t *tasks = arg;
-	json_t *pids = json_pack("[]");
-	if (cg_iterate_pids(namespace, name, one_pid, pids) == -1) {
-		return -1;
+	struct dump_args *args = arg;
+	struct json *json = args->json;
+
+	/* In watch mode, handles are kept from one dump to the other,
+	 * unless the task has been restarted. */
+	struct task_sample *previous = samples_find(args->previous, name);
+	struct task_sample *sample = NULL;
+	struct cg_handle *h = NULL;
+	if (previous) {
+		h = previous->h;
+		previous->h = NULL;
+		if (!cg_valid(h)) {
+			/* Restarted: not the same task */
+			cg_close(h);
+			h = NULL;
+			previous = NULL;
+		} else
+			args->matched++;
+	}
+	if (h == NULL && (h = cg_open(namespace, name)) == NULL)
+		return 0; /* Vanished */
+	if (args->current) {
+		if ((sample = samples_add(args->current, name)) == NULL) {
+			cg_close(h);
+			return -1;
+		}
+		sample->h = h;
+		sample->ts = dump_now();
+	}
+
+	struct dump_args pids = {
+		.json = json,
+		.pids = sample?&sample->pids:NULL,
+		.old_pids = previous?&previous->pids:NULL
+	};
+	int depth = json->depth;
+	json_key(json, name);
+	json_object_start(json);
+	json_key(json, "processes");
+	json_array_start(json);
+	if (cg_iterate_pids(h, args->threads, one_pid, &pids) == -1) {
+		if (errno != ENOENT && errno != ENODEV) {
+			if (!sample) cg_close(h);
+			json_unwind(json, depth);
+			return -1;
+		}
+		/* Vanished while dumping, the remaining properties are
+		 * unlikely to be available but the task is kept. */
 	}
-	json_t *result = json_pack("{s:i,s:o}",
-	    "count", json_array_size(pids),
-	    "processes", pids);
-	uint64_t cpu = cg_cpu_usage(namespace, name);
-	if (cpu)
-		json_object_set_new(result, "cpu", json_integer(cpu));
-	uint64_t memory = cg_memory_usage(namespace, name);
+	json_array_end(json);
+	dump_integer(json, "count", pids.count);
+
+	uint64_t cpu = cg_cpu_usage(h);
+	if (cpu) {
+		dump_integer(json, "cpu", cpu);
+		dump_cpu_detail(h, json);
+	}
+	uint64_t memory = cg_memory_usage(h);
 	if (memory)
-		json_object_set_new(result, "memory", json_integer(memory));
+		dump_integer(json, "memory", memory);
+	struct cg_memory_stat mstat;
+	if (cg_memory_stat(h, &mstat) == 0) {
+		json_key(json, "memory_stat");
+		json_object_start(json);
+		dump_integer(json, "rss", mstat.rss);
+		dump_integer(json, "cache", mstat.cache);
+		dump_integer(json, "mapped_file", mstat.mapped_file);
+		dump_integer(json, "swap", mstat.swap);
+		dump_integer(json, "dirty", mstat.dirty);
+		dump_integer(json, "writeback", mstat.writeback);
+		dump_integer(json, "active_file", mstat.active_file);
+		dump_integer(json, "inactive_file", mstat.inactive_file);
+		dump_integer(json, "max_usage", mstat.max_usage);
+		dump_integer(json, "failcnt", mstat.failcnt);
+		dump_integer(json, "kmem", mstat.kmem);
+		json_object_end(json);
+	}
+	struct task_events events;
+	if (events_load(namespace, name, &events) == 0) {
+		json_key(json, "memory_events");
+		json_object_start(json);
+		dump_integer(json, "low", events.memory[CG_MEMORY_LOW]);
+		dump_integer(json, "medium", events.memory[CG_MEMORY_MEDIUM]);
+		dump_integer(json, "critical", events.memory[CG_MEMORY_CRITICAL]);
+		dump_integer(json, "threshold", events.memory[CG_MEMORY_THRESHOLD]);
+		dump_integer(json, "oom", events.memory[CG_MEMORY_OOM]);
+		json_object_end(json);
+	}
+	uint64_t current, max;
+	if (cg_pids_current(h, &current) == 0 &&
+	    cg_pids_get_max(h, &max) == 0) {
+		json_key(json, "pids");
+		json_object_start(json);
+		dump_integer(json, "current", current);
+		json_key(json, "max");
+		if (max) json_integer(json, max);
+		else json_null(json);
+		json_object_end(json);
+	}
+	struct cg_io_stat io;
+	if (cg_io_stat(h, &io) == 0) {
+		json_key(json, "io");
+		json_object_start(json);
+		dump_integer(json, "read_bytes", io.read_bytes);
+		dump_integer(json, "write_bytes", io.write_bytes);
+		dump_integer(json, "read_ios", io.read_ios);
+		dump_integer(json, "write_ios", io.write_ios);
+		json_object_end(json);
+	}
+	struct cg_memory_oom oom;
+	if (cg_memory_oom(h, &oom) == 0) {
+		json_key(json, "oom");
+		json_object_start(json);
+		json_key(json, "disabled");
+		json_boolean(json, oom.disabled);
+		json_key(json, "under_oom");
+		json_boolean(json, oom.under_oom);
+		dump_integer(json, "oom", oom.oom);
+		dump_integer(json, "oom_kill", oom.oom_kill);
+		json_object_end(json);
+	}
+
+	if (sample) {
+		sample->cpu = cpu;
+		sample->memory = memory;
+	}
+	if (sample && previous) {
+		/* Changes since the previous dump */
+		uint64_t elapsed = sample->ts - previous->ts;
+		json_key(json, "delta");
+		json_object_start(json);
+		dump_integer(json, "elapsed", elapsed / 1000000);
+		if (cpu && cpu >= previous->cpu) {
+			dump_integer(json, "cpu", cpu - previous->cpu);
+			json_key(json, "cpu_percent");
+			json_real(json, elapsed?((cpu - previous->cpu) * 100. /
+				elapsed / args->nbcpus):0);
+		}
+		if (memory)
+			dump_integer(json, "memory",
+			    (int64_t)memory - (int64_t)previous->memory);
+		dump_integer(json, "processes_started", pids.started);
+		dump_integer(json, "processes_exited",
+		    previous->pids.count - (sample->pids.count - pids.started));
+		json_object_end(json);
+	}
+	if (!sample) cg_close(h);
+	json_object_end(json);
+
+	args->count++;
+	return json_flush(json);
+}
 
-	if (json_object_set_new(tasks, name, result) == -1) {
-		log_warnx("dump", "unable to record task %s", name);
+/* State of the namespace kept between two dumps in watch mode */
+struct ns_sample {
+	struct cg_handle *h;	/* Handle to the namespace */
+	uint64_t ts;		/* Time of the sample in nanoseconds */
+	uint64_t cpu;		/* CPU usage */
+};
+
+/**
+ * Dump a namespace as a single JSON document.
+ *
+ * @param namespace Namespace to dump.
+ * @param args      Arguments. In watch mode, current samples are filled and
+ *                  deltas are computed against previous samples.
+ * @param ns        Namespace sample in watch mode or NULL.
+ * @return 0 on success, -1 on error
+ */
+static int
+dump_namespace(const char *namespace, struct dump_args *args,
+    struct ns_sample *ns)
+{
+	struct json *json = args->json;
+	args->count = args->matched = 0;
+
+	json_object_start(json);
+	json_key(json, "namespace");
+	json_string(json, namespace);
+	json_key(json, "tasks");
+	json_object_start(json);
+	if (cg_iterate_tasks(namespace, one_task, args) == -1) {
+		log_warnx("dump", "error while walking tasks");
+		json_unwind(json, 0);
+		json_flush(json);
 		return -1;
 	}
-	return 0;
+	json_object_end(json);
+	dump_integer(json, "count", args->count);
+
+	struct cg_handle *h = ns?ns->h:NULL;
+	if (h == NULL) h = cg_open(namespace, NULL);
+	uint64_t cpu = h?cg_cpu_usage(h):0;
+	uint64_t now = dump_now();
+	if (cpu > 0) {
+		dump_integer(json, "cpu", cpu);
+		dump_cpu_detail(h, json);
+	}
+	if (args->nbcpus > 0)
+		dump_integer(json, "nbcpus", args->nbcpus);
+	dump_integer(json, "timestamp", now / 1000000);
+
+	if (ns && ns->ts) {
+		/* Changes since the previous dump */
+		uint64_t elapsed = now - ns->ts;
+		json_key(json, "delta");
+		json_object_start(json);
+		dump_integer(json, "elapsed", elapsed / 1000000);
+		if (cpu && cpu >= ns->cpu) {
+			dump_integer(json, "cpu", cpu - ns->cpu);
+			json_key(json, "cpu_percent");
+			json_real(json, elapsed?((cpu - ns->cpu) * 100. /
+				elapsed / args->nbcpus):0);
+		}
+		dump_integer(json, "tasks_started",
+		    args->current->count - args->matched);
+		dump_integer(json, "tasks_exited",
+		    args->previous->count - args->matched);
+		json_object_end(json);
+	}
+	json_object_end(json);
+
+	if (ns) {
+		ns->h = h;
+		ns->ts = now;
+		ns->cpu = cpu;
+	} else
+		cg_close(h);
+	return json_flush(json);
+}
+
+/**
+ * Dump a namespace at regular intervals, one JSON document per line.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+dump_watch(const char *namespace, struct dump_args *args, double interval)
+{
+	int rc = -1, tfd = -1, sfd = -1;
+	struct samples samples[2] = {};
+	struct ns_sample ns = {};
+
+	struct itimerspec its = {};
+	its.it_interval.tv_sec = (time_t)interval;
+	its.it_interval.tv_nsec = (interval - (time_t)interval) * 1e9;
+	its.it_value = its.it_interval;
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1 ||
+	    timerfd_settime(tfd, 0, &its, NULL) == -1) {
+		log_warn("dump", "unable to setup timer");
+		goto end;
+	}
+	/* Do not stop in the middle of a document */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1 ||
+	    (sfd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1) {
+		log_warn("dump", "unable to setup signal handling");
+		goto end;
+	}
+
+	struct pollfd fds[] = {
+		{ .fd = tfd, .events = POLLIN },
+		{ .fd = sfd, .events = POLLIN },
+	};
+	for (int i = 0;; i = !i) {
+		/* The first document has no delta */
+		args->current = &samples[i];
+		args->previous = (ns.ts > 0)?&samples[!i]:NULL;
+		if (dump_namespace(namespace, args, &ns) == -1) goto end;
+		qsort(samples[i].tasks, samples[i].count,
+		    sizeof(struct task_sample), sample_compare);
+		samples_free(&samples[!i]);
+
+		if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+			log_warn("dump", "unable to wait for timer");
+			goto end;
+		}
+		if (fds[1].revents & POLLIN) break;
+		uint64_t expirations;
+		if ((fds[0].revents & POLLIN) &&
+		    read(tfd, &expirations, sizeof(expirations)) == -1) {
+			log_warn("dump", "unable to read timer");
+			goto end;
+		}
+	}
+	rc = 0;
+
+end:
+	samples_free(&samples[0]);
+	samples_free(&samples[1]);
+	free(samples[0].tasks);
+	free(samples[1].tasks);
+	if (ns.h) cg_close(ns.h);
+	if (tfd != -1) close(tfd);
+	if (sfd != -1) close(sfd);
+	return rc;
 }
 
 int
 cmd_dump(const char *namespace, int argc, char * const argv[])
 {
 	int ch;
+	int threads = 0;
+	double interval = 0;
+	char *end;
 
-	while ((ch = getopt(argc, argv, "h")) != -1) {
+	while ((ch = getopt(argc, argv, "htw:")) != -1) {
 		switch (ch) {
 		case 'h':
 			usage();
 			return 0;
+		case 't':
+			threads = 1;
+			break;
+		case 'w':
+			interval = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' ||
+			    interval < 0.1 || interval > 86400) {
+				usage();
+				return -1;
+			}
+			break;
 		default:
 			usage();
 			return -1;
 		}
 	}
 
-	json_t *tasks = json_pack("{}");
-
-	if (cg_iterate_tasks(namespace, one_task, tasks) == -1) {
-		log_warnx("ls", "error while walking tasks");
-		return -1;
+	struct json json;
+	struct dump_args args = { .json = &json, .threads = threads };
+	args.nbcpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (args.nbcpus <= 0) args.nbcpus = 1;
+	if (interval > 0) {
+		json_init(&json, stdout, 0);
+		return dump_watch(namespace, &args, interval);
 	}
-
-	uint64_t cpu = cg_cpu_usage(namespace, NULL);
-	int nbcpus = sysconf(_SC_NPROCESSORS_ONLN);
-
-	json_t *result = json_pack("{s:s,s:i,s:o}",
-	    "namespace", namespace,
-	    "count", json_object_size(tasks),
-	    "tasks", tasks);
-	if (cpu > 0)
-		json_object_set_new(result, "cpu",
-		    json_integer(cpu));
-	if (nbcpus > 0)
-		json_object_set_new(result, "nbcpus",
-		    json_integer(nbcpus));
-
-	struct timespec tspec;
-	if (clock_gettime(CLOCK_MONOTONIC, &tspec) == 0)
-		json_object_set_new(result, "timestamp",
-		    json_integer(tspec.tv_sec * 1000 +
-			tspec.tv_nsec / (1000*1000)));
-
-	json_dumpf(result, stdout, JSON_INDENT(1));
-
-	return 0;
+	json_init(&json, stdout, 1);
+	return dump_namespace(namespace, &args, NULL);
 }
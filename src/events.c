@@ -0,0 +1,254 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vincent.bernat@dailymotion.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "lanco.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/*
+ * Events about a task are counted by the monitor command and stored in
+ * /var/run/lanco-XXXX/task-events-XXXXX, one "name count" per line, for
+ * other commands to report them. The file is reset when the task is run.
+ */
+
+static const char *events_memory_names[CG_MEMORY_EVENT_MAX] = {
+	[CG_MEMORY_LOW]       = "memory.low",
+	[CG_MEMORY_MEDIUM]    = "memory.medium",
+	[CG_MEMORY_CRITICAL]  = "memory.critical",
+	[CG_MEMORY_THRESHOLD] = "memory.threshold",
+	[CG_MEMORY_OOM]       = "memory.oom",
+};
+
+/**
+ * Get path to the file containing events for a task.
+ *
+ * @return the path (to be freed) or NULL on error
+ */
+static char *
+events_path(const char *namespace, const char *task)
+{
+	char *path = NULL;
+	if (asprintf(&path, RUNPREFIX "/lanco-%s/task-events-%s",
+		namespace, task) == -1) {
+		log_warn("events", "unable to allocate memory for events file");
+		return NULL;
+	}
+	return path;
+}
+
+/**
+ * Load events recorded for a task.
+ *
+ * @param namespace Namespace.
+ * @param task      Task name.
+ * @param events    Where to store events. Unknown events are set to 0.
+ * @return 0 on success, -1 if no events were recorded
+ */
+int
+events_load(const char *namespace, const char *task,
+    struct task_events *events)
+{
+	memset(events, 0, sizeof(*events));
+	char *path = events_path(namespace, task);
+	if (path == NULL) return -1;
+	FILE *f = fopen(path, "r");
+	free(path);
+	if (f == NULL) return -1;
+
+	char name[64];
+	long long unsigned count;
+	while (fscanf(f, "%63s %llu", name, &count) == 2) {
+		for (int i = 0; i < CG_MEMORY_EVENT_MAX; i++)
+			if (!strcmp(name, events_memory_names[i]))
+				events->memory[i] = count;
+	}
+	fclose(f);
+	return 0;
+}
+
+/**
+ * Load events recorded for a task only if they have changed.
+ *
+ * The file is replaced on each save. Its inode and modification time are
+ * enough to know if it should be read again. This avoids parsing it on
+ * each refresh.
+ *
+ * @param namespace Namespace.
+ * @param task      Task name.
+ * @param events    Events previously loaded, updated on change.
+ * @param stamp     Stamp of the file previously loaded, updated on change.
+ *                  It should be zeroed before the first call.
+ */
+void
+events_refresh(const char *namespace, const char *task,
+    struct task_events *events, struct events_stamp *stamp)
+{
+	struct stat a;
+	char *path = events_path(namespace, task);
+	if (path == NULL) return;
+	if (stat(path, &a) == -1) {
+		free(path);
+		memset(events, 0, sizeof(*events));
+		memset(stamp, 0, sizeof(*stamp));
+		return;
+	}
+	free(path);
+	if (a.st_ino == stamp->ino &&
+	    a.st_mtim.tv_sec == stamp->mtime.tv_sec &&
+	    a.st_mtim.tv_nsec == stamp->mtime.tv_nsec)
+		return;
+	stamp->ino = a.st_ino;
+	stamp->mtime = a.st_mtim;
+	events_load(namespace, task, events);
+}
+
+/**
+ * Save events recorded for a task.
+ *
+ * The file is replaced atomically so readers never see a partial content.
+ *
+ * @param namespace Namespace.
+ * @param task      Task name.
+ * @param events    Events to save.
+ * @return 0 on success, -1 on error
+ */
+int
+events_save(const char *namespace, const char *task,
+    const struct task_events *events)
+{
+	int rc = -1;
+	char *path = events_path(namespace, task);
+	char *tmp = NULL;
+	FILE *f = NULL;
+	if (path == NULL) return -1;
+	if (asprintf(&tmp, "%s.new", path) == -1) {
+		log_warn("events", "unable to allocate memory for events file");
+		goto end;
+	}
+	if ((f = fopen(tmp, "w")) == NULL) {
+		log_warn("events", "unable to create file %s", tmp);
+		goto end;
+	}
+	for (int i = 0; i < CG_MEMORY_EVENT_MAX; i++)
+		fprintf(f, "%s %" PRIu64 "\n",
+		    events_memory_names[i], events->memory[i]);
+	if (fclose(f) == EOF) {
+		f = NULL;
+		log_warn("events", "unable to write file %s", tmp);
+		goto end;
+	}
+	f = NULL;
+	if (rename(tmp, path) == -1) {
+		log_warn("events", "unable to rename %s", tmp);
+		goto end;
+	}
+	rc = 0;
+end:
+	if (f) fclose(f);
+	if (rc == -1 && tmp) unlink(tmp);
+	free(tmp);
+	free(path);
+	return rc;
+}
+
+/**
+ * Forget events recorded for a task.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+events_reset(const char *namespace, const char *task)
+{
+	char *path = events_path(namespace, task);
+	if (path == NULL) return -1;
+	if (unlink(path) == -1 && errno != ENOENT) {
+		log_warn("events", "unable to remove %s", path);
+		free(path);
+		return -1;
+	}
+	free(path);
+	return 0;
+}
+
+/**
+ * Parse an OOM policy.
+ *
+ * A policy is either "kill" (kill the largest process), "stop" (kill the
+ * whole task) or "raise:STEP" (raise the memory limit by STEP bytes).
+ *
+ * @param spec   Policy to parse.
+ * @param policy Where to store the result.
+ * @return 0 on success, -1 on error
+ */
+int
+events_parse_oom_policy(const char *spec, struct oom_policy *policy)
+{
+	char *end;
+	memset(policy, 0, sizeof(*policy));
+	if (!strcmp(spec, "kill"))
+		policy->action = OOM_POLICY_KILL;
+	else if (!strcmp(spec, "stop"))
+		policy->action = OOM_POLICY_STOP;
+	else if (!strncmp(spec, "raise:", strlen("raise:"))) {
+		spec += strlen("raise:");
+		policy->action = OOM_POLICY_RAISE;
+		policy->step = strtoull(spec, &end, 10);
+		if (*spec == '\0' || *end != '\0' || policy->step == 0) {
+			log_warnx("events", "invalid step for OOM policy: %s",
+			    spec);
+			return -1;
+		}
+	} else {
+		log_warnx("events", "unknown OOM policy %s", spec);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Load the OOM policy registered for a task in
+ * /var/run/lanco-XXXX/task-oom-XXXXX.
+ *
+ * @param namespace Namespace.
+ * @param task      Task name.
+ * @param policy    Where to store the policy.
+ * @return 0 on success, -1 if there is no valid policy
+ */
+int
+events_load_oom_policy(const char *namespace, const char *task,
+    struct oom_policy *policy)
+{
+	char *path = NULL;
+	char spec[64];
+	memset(policy, 0, sizeof(*policy));
+	if (asprintf(&path, RUNPREFIX "/lanco-%s/task-oom-%s",
+		namespace, task) == -1) {
+		log_warn("events", "unable to allocate memory for OOM policy");
+		return -1;
+	}
+	FILE *f = fopen(path, "r");
+	free(path);
+	if (f == NULL) return -1;
+	int n = fscanf(f, "%63s", spec);
+	fclose(f);
+	if (n != 1) return -1;
+	return events_parse_oom_policy(spec, policy);
+}
@@ -0,0 +1,246 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vincent.bernat@dailymotion.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "lanco.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+/*
+ * Streaming JSON writer. Values are written as soon as they are provided,
+ * nothing is kept in memory except one bit per nesting level to know if a
+ * separator is needed. The caller is responsible for the structure of the
+ * document (keys only inside objects, balanced containers). On error,
+ * json_unwind() closes what is still open.
+ */
+
+/**
+ * Initialize a JSON writer.
+ *
+ * @param json   Writer to initialize.
+ * @param out    Output stream.
+ * @param indent Number of spaces for each nesting level, 0 for a compact
+ *               output on a single line.
+ */
+void
+json_init(struct json *json, FILE *out, int indent)
+{
+	memset(json, 0, sizeof(*json));
+	json->out = out;
+	json->indent = indent;
+}
+
+/* Write the separator and the indentation needed before a new value */
+static void
+json_separator(struct json *json)
+{
+	if (json->key) {
+		/* The value of a key is on the same line */
+		json->key = 0;
+		return;
+	}
+	if (json->depth == 0) return;
+	uint64_t bit = 1ULL << ((json->depth - 1) % 64);
+	if (json->filled & bit) fputc(',', json->out);
+	json->filled |= bit;
+	if (json->indent)
+		fprintf(json->out, "\n%*s", json->depth * json->indent, "");
+}
+
+static void
+json_open(struct json *json, char c)
+{
+	json_separator(json);
+	fputc(c, json->out);
+	json->depth++;
+	uint64_t bit = 1ULL << ((json->depth - 1) % 64);
+	json->filled &= ~bit;
+	if (c == '[') json->arrays |= bit;
+	else json->arrays &= ~bit;
+}
+
+static void
+json_close(struct json *json, char c)
+{
+	uint64_t bit = 1ULL << ((json->depth - 1) % 64);
+	json->depth--;
+	if ((json->filled & bit) && json->indent)
+		fprintf(json->out, "\n%*s", json->depth * json->indent, "");
+	fputc(c, json->out);
+	if (json->depth == 0) fputc('\n', json->out);
+}
+
+void
+json_object_start(struct json *json)
+{
+	json_open(json, '{');
+}
+
+void
+json_object_end(struct json *json)
+{
+	json_close(json, '}');
+}
+
+void
+json_array_start(struct json *json)
+{
+	json_open(json, '[');
+}
+
+void
+json_array_end(struct json *json)
+{
+	json_close(json, ']');
+}
+
+/* Write a string with the appropriate escaping. Invalid UTF-8 sequences
+ * are replaced by U+FFFD. */
+static void
+json_escape(struct json *json, const char *str)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	fputc('"', json->out);
+	while (*s) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(json->out, "\\%c", *s++);
+			continue;
+		}
+		if (*s < 0x20) {
+			switch (*s) {
+			case '\n': fputs("\\n", json->out); break;
+			case '\t': fputs("\\t", json->out); break;
+			case '\r': fputs("\\r", json->out); break;
+			default: fprintf(json->out, "\\u%04x", *s); break;
+			}
+			s++;
+			continue;
+		}
+		if (*s < 0x80) {
+			fputc(*s++, json->out);
+			continue;
+		}
+
+		/* Multibyte sequence */
+		int len = (*s >= 0xc2 && *s <= 0xdf)?2:
+		    (*s >= 0xe0 && *s <= 0xef)?3:
+		    (*s >= 0xf0 && *s <= 0xf4)?4:0;
+		int i;
+		for (i = 1; i < len; i++)
+			if ((s[i] & 0xc0) != 0x80) break;
+		if (len == 0 || i != len ||
+		    (*s == 0xe0 && s[1] < 0xa0) ||	/* Overlong */
+		    (*s == 0xed && s[1] > 0x9f) ||	/* Surrogate */
+		    (*s == 0xf0 && s[1] < 0x90) ||	/* Overlong */
+		    (*s == 0xf4 && s[1] > 0x8f)) {	/* Too large */
+			fputs("\\ufffd", json->out);
+			s++;
+			continue;
+		}
+		fwrite(s, 1, len, json->out);
+		s += len;
+	}
+	fputc('"', json->out);
+}
+
+/**
+ * Write a key in the current object. It should be followed by its value.
+ */
+void
+json_key(struct json *json, const char *key)
+{
+	json_separator(json);
+	json_escape(json, key);
+	fputs(json->indent?": ":":", json->out);
+	json->key = 1;
+}
+
+/**
+ * Write a string or null if the string is NULL.
+ */
+void
+json_string(struct json *json, const char *str)
+{
+	if (str == NULL) {
+		json_null(json);
+		return;
+	}
+	json_separator(json);
+	json_escape(json, str);
+}
+
+void
+json_integer(struct json *json, int64_t value)
+{
+	json_separator(json);
+	fprintf(json->out, "%" PRId64, value);
+}
+
+void
+json_real(struct json *json, double value)
+{
+	json_separator(json);
+	fprintf(json->out, "%.2f", value);
+}
+
+void
+json_boolean(struct json *json, int value)
+{
+	json_separator(json);
+	fputs(value?"true":"false", json->out);
+}
+
+void
+json_null(struct json *json)
+{
+	json_separator(json);
+	fputs("null", json->out);
+}
+
+/**
+ * Close the containers opened after the given nesting level. This is used
+ * on error to keep the document well-formed. A pending key is given a null
+ * value.
+ *
+ * @param json  Writer.
+ * @param depth Nesting level to get back to, 0 to end the document.
+ */
+void
+json_unwind(struct json *json, int depth)
+{
+	if (json->key && json->depth > depth) json_null(json);
+	while (json->depth > depth) {
+		uint64_t bit = 1ULL << ((json->depth - 1) % 64);
+		json_close(json, (json->arrays & bit)?']':'}');
+	}
+}
+
+/**
+ * Flush what has been written so far.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+json_flush(struct json *json)
+{
+	if (fflush(json->out) == EOF || ferror(json->out)) {
+		log_warn("json", "unable to write JSON output");
+		return -1;
+	}
+	return 0;
+}
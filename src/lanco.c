@@ -52,6 +52,7 @@ static struct cmd lanco_cmds[] = {
 	{ "ls",      cmd_ls },
 	{ "top",     cmd_top },
 	{ "dump",    cmd_dump },
+	{ "monitor", cmd_monitor },
 	{ NULL }
 };
 
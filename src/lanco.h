@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <time.h>
 #include <sys/types.h>
 
 #define LOGPREFIX "/var/log"
@@ -42,29 +43,160 @@ int cmd_release(const char *, int, char * const *);
 int cmd_ls     (const char *, int, char * const *);
 int cmd_top    (const char *, int, char * const *);
 int cmd_dump   (const char *, int, char * const *);
+int cmd_monitor(const char *, int, char * const *);
 
 /* cgroups.c */
 #define CGROOTPARENT "/sys/fs"
 #define CGROOT CGROOTPARENT "/cgroup"
+#define CGCPU CGROOT "/cpu"
 #define CGCPUACCT CGROOT "/cpuacct"
 #define CGCPUCPUACCT CGROOT "/cpu,cpuacct"
 #define CGMEMORY CGROOT "/memory"
+#define CGCPUSET CGROOT "/cpuset"
+#define CGBLKIO CGROOT "/blkio"
+#define CGPIDS CGROOT "/pids"
+int cg_unified(void);
 int cg_setup_hierarchies(const char *, uid_t, gid_t);
 int cg_delete_hierarchies(const char*);
 int cg_exist_named_hierarchy(const char*);
-int cg_exist_task(const char*, const char*, ino_t *);
+struct cg_handle;
+struct cg_handle *cg_open(const char*, const char*);
+void cg_close(struct cg_handle *);
+int cg_valid(struct cg_handle *);
+ino_t cg_inode(struct cg_handle *);
+int cg_exist_task(const char*, const char*);
 int cg_create_task(const char*, const char*);
 int cg_release_task(const char*, const char*);
-int cg_kill_task(const char*, const char*, ino_t, int);
+int cg_kill_task(struct cg_handle *, int);
+void cg_kill_pid(struct cg_handle *, pid_t, int);
+int cg_watch_task(struct cg_handle *);
+int cg_watch_events(struct cg_handle *);
 int cg_iterate_tasks(const char *,
     int(*visit)(const char *, const char *, void *),
     void *);
-int cg_iterate_pids(const char *, const char *,
+int cg_iterate_pids(struct cg_handle *, int,
     int(*visit)(const char *, const char *, pid_t, void*),
     void *);
-uint64_t cg_cpu_usage(const char*, const char*);
-uint64_t cg_memory_usage(const char*, const char*);
-int cg_memory_limit(const char*, const char*, long long unsigned);
+uint64_t cg_cpu_usage(struct cg_handle *);
+int cg_cpu_percpu(struct cg_handle *, uint64_t *, size_t);
+int cg_cpu_stat(struct cg_handle *, uint64_t *, uint64_t *);
+int cg_cpu_limit(struct cg_handle *, double);
+int cg_cpu_shares(struct cg_handle *, unsigned);
+int cg_cpuset(struct cg_handle *, const char *, const char *);
+uint64_t cg_memory_usage(struct cg_handle *);
+struct cg_memory_stat {
+	uint64_t rss;		/* Anonymous memory */
+	uint64_t cache;		/* Page cache */
+	uint64_t mapped_file;	/* Page cache mapped by processes */
+	uint64_t swap;		/* Swap usage */
+	uint64_t dirty;		/* Page cache waiting to be written */
+	uint64_t writeback;	/* Page cache being written */
+	uint64_t active_file;	/* Page cache on active list */
+	uint64_t inactive_file;	/* Page cache on inactive list */
+	uint64_t max_usage;	/* Memory usage watermark */
+	uint64_t failcnt;	/* Number of times the limit was hit */
+	uint64_t kmem;		/* Kernel memory */
+};
+int cg_memory_stat(struct cg_handle *, struct cg_memory_stat *);
+int cg_memory_limit(struct cg_handle *, long long unsigned);
+uint64_t cg_memory_get_limit(struct cg_handle *);
+enum cg_memory_event {
+	CG_MEMORY_LOW,		/* Low memory pressure */
+	CG_MEMORY_MEDIUM,	/* Medium memory pressure */
+	CG_MEMORY_CRITICAL,	/* Critical memory pressure */
+	CG_MEMORY_THRESHOLD,	/* Memory usage threshold crossed */
+	CG_MEMORY_OOM,		/* Out of memory */
+	CG_MEMORY_EVENT_MAX
+};
+int cg_memory_notify(struct cg_handle *, enum cg_memory_event, uint64_t,
+    uint32_t *);
+int cg_memory_notified(struct cg_handle *, enum cg_memory_event, uint32_t);
+struct cg_memory_oom {
+	int disabled;		/* Is the OOM killer disabled? */
+	int under_oom;		/* Is the task under OOM? */
+	uint64_t oom;		/* Number of OOM situations (v2 only) */
+	uint64_t oom_kill;	/* Number of processes killed by OOM killer */
+};
+int cg_memory_oom(struct cg_handle *, struct cg_memory_oom *);
+int cg_memory_oom_disable(struct cg_handle *, int);
+struct cg_io_stat {
+	uint64_t read_bytes;	/* Bytes read */
+	uint64_t write_bytes;	/* Bytes written */
+	uint64_t read_ios;	/* Read operations */
+	uint64_t write_ios;	/* Write operations */
+};
+int cg_io_stat(struct cg_handle *, struct cg_io_stat *);
+int cg_io_weight(struct cg_handle *, unsigned);
+enum cg_io_limit {
+	CG_IO_READ_BPS,		/* Bytes read per second */
+	CG_IO_WRITE_BPS,	/* Bytes written per second */
+	CG_IO_READ_IOPS,	/* Read operations per second */
+	CG_IO_WRITE_IOPS,	/* Write operations per second */
+	CG_IO_LIMIT_MAX
+};
+int cg_io_limit(struct cg_handle *, enum cg_io_limit, dev_t, uint64_t);
+int cg_pids_current(struct cg_handle *, uint64_t *);
+int cg_pids_get_max(struct cg_handle *, uint64_t *);
+int cg_pids_max(struct cg_handle *, uint64_t);
+
+/* pidset.c */
+struct pidset {
+	pid_t *pids;		/* Hash table, 0 is a free slot */
+	size_t size;		/* Number of slots */
+	size_t count;		/* Number of PIDs */
+};
+void pidset_init(struct pidset *);
+int pidset_add(struct pidset *, pid_t);
+int pidset_contains(const struct pidset *, pid_t);
+void pidset_free(struct pidset *);
+
+/* events.c */
+struct task_events {
+	uint64_t memory[CG_MEMORY_EVENT_MAX]; /* Memory notifications */
+};
+struct events_stamp {
+	ino_t ino;		/* Inode of the events file, 0 if absent */
+	struct timespec mtime;	/* Modification time of the events file */
+};
+int events_load(const char *, const char *, struct task_events *);
+void events_refresh(const char *, const char *, struct task_events *,
+    struct events_stamp *);
+int events_save(const char *, const char *, const struct task_events *);
+int events_reset(const char *, const char *);
+struct oom_policy {
+	enum {
+		OOM_POLICY_NONE,	/* Let the kernel handle OOM */
+		OOM_POLICY_KILL,	/* Kill the largest process */
+		OOM_POLICY_STOP,	/* Kill the whole task */
+		OOM_POLICY_RAISE	/* Raise the memory limit */
+	} action;
+	uint64_t step;		/* Step to raise the memory limit */
+};
+int events_parse_oom_policy(const char *, struct oom_policy *);
+int events_load_oom_policy(const char *, const char *, struct oom_policy *);
+
+/* json.c */
+struct json {
+	FILE *out;		/* Output stream */
+	int indent;		/* Spaces per level, 0 for compact output */
+	int depth;		/* Current nesting level */
+	int key;		/* Was a key just written? */
+	uint64_t filled;	/* Non-empty containers, one bit per level */
+	uint64_t arrays;	/* Arrays, one bit per level */
+};
+void json_init(struct json *, FILE *, int);
+void json_object_start(struct json *);
+void json_object_end(struct json *);
+void json_array_start(struct json *);
+void json_array_end(struct json *);
+void json_key(struct json *, const char *);
+void json_string(struct json *, const char *);
+void json_integer(struct json *, int64_t);
+void json_real(struct json *, double);
+void json_boolean(struct json *, int);
+void json_null(struct json *);
+void json_unwind(struct json *, int);
+int json_flush(struct json *);
 
 /* utils.c */
 int utils_is_mount_point(const char *, const char *);
@@ -74,5 +206,14 @@ int utils_is_valid_name(const char *);
 int utils_create_subdirectory(const char*, const char*, uid_t, gid_t);
 int utils_redirect_output(const char *);
 char * utils_cmdline(pid_t);
+char * utils_human_size(uint64_t, char *, size_t);
+uint64_t utils_rss(pid_t);
+struct proc_stat {
+	char comm[16];		/* Command name */
+	char state;		/* State (R, S, D, Z, T, ...) */
+	uint64_t cpu;		/* User and system time in nanoseconds */
+};
+int utils_proc_stat(pid_t, struct proc_stat *);
+int utils_parse_device(const char *, dev_t *);
 
 #endif
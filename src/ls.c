@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <errno.h>
 
 extern const char *__progname;
 
@@ -31,19 +32,25 @@ usage(void)
 	fprintf(stderr, "Version: %s\n", PACKAGE_STRING);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "-l         don't truncate command.\n");
+	fprintf(stderr, "-t         show threads instead of processes.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "see manual page lanco(8) for more information\n");
 }
 
 #define MAX_COMMAND_LEN 50
 
+struct ls_options {
+	int truncate;		/* Truncate commands */
+	int threads;		/* Show threads instead of processes */
+};
+
 static int
 one_pid(const char *namespace, const char *task, pid_t pid, void *arg)
 {
-	int *truncate = arg;
+	struct ls_options *options = arg;
 	char *command = utils_cmdline(pid);
 	if (command) command = strdup(command);
-	if (*truncate && strlen(command) > MAX_COMMAND_LEN) {
+	if (options->truncate && strlen(command) > MAX_COMMAND_LEN) {
 		char *ellipsis = "…";
 		size_t ellipsis_len = strlen(ellipsis);
 		strcpy(command + MAX_COMMAND_LEN - ellipsis_len,
@@ -57,24 +64,33 @@ one_pid(const char *namespace, const char *task, pid_t pid, void *arg)
 static int
 one_task(const char *namespace, const char *task, void *arg)
 {
-	int *truncate = arg;
+	struct ls_options *options = arg;
 	fprintf(stdout, " ├ %s\n", task);
-	return cg_iterate_pids(namespace, task, one_pid, truncate);
+	struct cg_handle *h = cg_open(namespace, task);
+	if (h == NULL) return 0; /* Vanished */
+	int rc = cg_iterate_pids(h, options->threads, one_pid, options);
+	if (rc == -1 && (errno == ENOENT || errno == ENODEV))
+		rc = 0;		/* Vanished */
+	cg_close(h);
+	return rc;
 }
 
 int
 cmd_ls(const char *namespace, int argc, char * const argv[])
 {
 	int ch;
-	int truncate = 1;
+	struct ls_options options = { .truncate = 1, .threads = 0 };
 
-	while ((ch = getopt(argc, argv, "hl")) != -1) {
+	while ((ch = getopt(argc, argv, "hlt")) != -1) {
 		switch (ch) {
 		case 'h':
 			usage();
 			return 0;
 		case 'l':
-			truncate = 0;
+			options.truncate = 0;
+			break;
+		case 't':
+			options.threads = 1;
 			break;
 		default:
 			usage();
@@ -83,7 +99,7 @@ cmd_ls(const char *namespace, int argc, char * const argv[])
 	}
 
 	fprintf(stdout, "%s\n", namespace);
-	if (cg_iterate_tasks(namespace, one_task, &truncate) == -1) {
+	if (cg_iterate_tasks(namespace, one_task, &options) == -1) {
 		log_warnx("ls", "error while walking tasks");
 		return -1;
 	}
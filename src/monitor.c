@@ -0,0 +1,450 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vincent.bernat@dailymotion.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "lanco.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+
+extern const char *__progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s <namespace> monitor [OPTIONS ...]\n",
+		__progname);
+	fprintf(stderr, "Version: %s\n", PACKAGE_STRING);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-u percent memory usage threshold, in percent of the limit.\n");
+	fprintf(stderr, "           default: 90, 0 to disable\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "see manual page lanco(8) for more information\n");
+}
+
+struct watched_task;
+struct notification {
+	struct watched_task *task;	/* Task notified */
+	enum cg_memory_event event;	/* Event notified */
+};
+
+struct watched_task {
+	TAILQ_ENTRY (watched_task) next;
+	int valid;		/* Is the task still valid? */
+	int gone;		/* Are notifications unavailable? */
+	int oom_disabled;	/* Has the kernel OOM killer been disabled? */
+	char *name;		/* Task name */
+	struct cg_handle *cg;	/* Handle to the task cgroup */
+	struct task_events events; /* Events received */
+	pid_t hook;		/* PID of running hook or 0 */
+	struct notification notifications[CG_MEMORY_EVENT_MAX];
+};
+TAILQ_HEAD(watched_tasks, watched_task);
+
+struct monitor_args {
+	struct watched_tasks tasks; /* Tasks watched */
+	int epfd;		/* epoll instance for all notifications */
+	int threshold;		/* Usage threshold in percent of the limit */
+};
+
+/**
+ * Execute the command registered for a task on critical memory pressure.
+ * This is done by executing /var/run/lanco-XXXX/task-pressure-XXXXX with the
+ * UID/GID of the file owner. We don't wait for the command to finish but
+ * we don't run it again while it is still running.
+ */
+static void
+monitor_hook(const char *namespace, struct watched_task *task)
+{
+	char *path = NULL;
+	if (task->hook != 0) {
+		log_debug("monitor", "hook for task %s is still running",
+		    task->name);
+		return;
+	}
+	if (asprintf(&path, RUNPREFIX "/lanco-%s/task-pressure-%s",
+		namespace, task->name) == -1) {
+		log_warn("monitor", "unable to allocate memory for executing hook");
+		return;
+	}
+
+	struct stat a;
+	if (stat(path, &a) == -1) {
+		log_debug("monitor", "no command to execute for task %s",
+		    task->name);
+		free(path);
+		return;
+	}
+
+	pid_t pid = fork();
+	switch (pid) {
+	case -1:
+		log_warn("monitor", "unable to fork to execute hook");
+		break;
+	case 0:
+		if (setresgid(a.st_gid, a.st_gid, a.st_gid) == -1 ||
+		    setresuid(a.st_uid, a.st_uid, a.st_uid) == -1) {
+			log_warn("monitor", "unable to change UID/GID to %d:%d",
+			    a.st_uid, a.st_gid);
+			_exit(1);
+		}
+		execl("/bin/sh", "sh", path, NULL);
+		log_warn("monitor", "unable to execute the provided command");
+		_exit(1);
+	default:
+		log_info("monitor", "execute hook for task %s", task->name);
+		task->hook = pid;
+	}
+	free(path);
+}
+
+/**
+ * Find the process using the most memory in a task.
+ */
+static int
+largest_pid(const char *namespace, const char *name, pid_t pid, void *arg)
+{
+	struct { pid_t pid; uint64_t rss; } *largest = arg;
+	uint64_t rss = utils_rss(pid);
+	if (rss > largest->rss) {
+		largest->pid = pid;
+		largest->rss = rss;
+	}
+	return 0;
+}
+
+/**
+ * Apply the OOM policy registered for a task. Without policy, the kernel OOM
+ * killer handles the situation.
+ */
+static void
+monitor_oom(const char *namespace, struct watched_task *task)
+{
+	struct oom_policy policy;
+	if (events_load_oom_policy(namespace, task->name, &policy) == -1) {
+		log_debug("monitor", "no OOM policy for task %s", task->name);
+		return;
+	}
+	switch (policy.action) {
+	case OOM_POLICY_KILL: {
+		struct { pid_t pid; uint64_t rss; } largest = {};
+		cg_iterate_pids(task->cg, 0, largest_pid, &largest);
+		if (largest.pid == 0) {
+			log_warnx("monitor", "no process to kill in task %s",
+			    task->name);
+			return;
+		}
+		log_info("monitor", "kill PID %d using the most memory in task %s",
+		    largest.pid, task->name);
+		cg_kill_pid(task->cg, largest.pid, SIGKILL);
+		break;
+	}
+	case OOM_POLICY_STOP:
+		log_info("monitor", "kill task %s on OOM", task->name);
+		if (cg_kill_task(task->cg, SIGKILL) == -1)
+			log_warnx("monitor", "unable to kill task %s", task->name);
+		break;
+	case OOM_POLICY_RAISE: {
+		uint64_t limit = cg_memory_get_limit(task->cg);
+		if (limit == 0) {
+			log_warnx("monitor", "no memory limit to raise for task %s",
+			    task->name);
+			return;
+		}
+		log_info("monitor", "raise memory limit of task %s to %" PRIu64,
+		    task->name, limit + policy.step);
+		if (cg_memory_limit(task->cg, limit + policy.step) == -1)
+			log_warnx("monitor", "unable to raise memory limit for "
+			    "task %s", task->name);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/**
+ * Take over the kernel OOM killer for a task with an OOM policy. Processes
+ * of the task are paused on OOM until the policy is applied.
+ */
+static void
+monitor_oom_takeover(const char *namespace, struct watched_task *task)
+{
+	struct oom_policy policy;
+	if (events_load_oom_policy(namespace, task->name, &policy) == -1)
+		return;
+	if (cg_memory_oom_disable(task->cg, 1) == -1) {
+		log_warnx("monitor", "unable to disable OOM killer for task %s",
+		    task->name);
+		return;
+	}
+	log_debug("monitor", "OOM killer disabled for task %s", task->name);
+	task->oom_disabled = 1;
+}
+
+/**
+ * Give back the OOM handling of a task to the kernel. Otherwise, processes
+ * of the task would be paused forever on OOM once monitor is stopped.
+ */
+static void
+monitor_oom_release(struct watched_task *task)
+{
+	if (!task->oom_disabled || !cg_valid(task->cg)) return;
+	if (cg_memory_oom_disable(task->cg, 0) == -1) {
+		log_warnx("monitor", "unable to enable OOM killer for task %s",
+		    task->name);
+		return;
+	}
+	log_debug("monitor", "OOM killer enabled for task %s", task->name);
+	task->oom_disabled = 0;
+}
+
+/**
+ * Register memory notifications for a new task.
+ */
+static void
+monitor_register(struct monitor_args *args, struct watched_task *task)
+{
+	uint64_t limit = cg_memory_get_limit(task->cg);
+	for (int i = 0; i < CG_MEMORY_EVENT_MAX; i++) {
+		uint64_t threshold = 0;
+		if (i == CG_MEMORY_THRESHOLD) {
+			if (limit == 0 || args->threshold == 0) continue;
+			threshold = limit / 100 * args->threshold;
+		}
+		uint32_t events;
+		int fd = cg_memory_notify(task->cg, i, threshold, &events);
+		if (fd == -1) continue;
+		task->notifications[i].task = task;
+		task->notifications[i].event = i;
+		struct epoll_event event = {
+			.events = events,
+			.data.ptr = &task->notifications[i]
+		};
+		if (epoll_ctl(args->epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+			log_warn("monitor", "unable to watch memory events for "
+			    "task %s", task->name);
+	}
+}
+
+static int
+one_task(const char *namespace, const char *name, void *arg)
+{
+	struct monitor_args *args = arg;
+	struct watched_task *task;
+	TAILQ_FOREACH(task, &args->tasks, next)
+	    if (!strcmp(task->name, name)) break;
+	if (task && (task->gone || !cg_valid(task->cg))) {
+		/* The task has been restarted or is being released, forget
+		 * it */
+		task = NULL;
+	}
+	if (task == NULL) {
+		if ((task = calloc(1, sizeof(struct watched_task))) == NULL ||
+		    (task->name = strdup(name)) == NULL) {
+			log_warn("monitor", "unable to allocate memory for task %s",
+			    name);
+			free(task);
+			return -1;
+		}
+		if ((task->cg = cg_open(namespace, name)) == NULL) {
+			/* Vanished */
+			free(task->name);
+			free(task);
+			return 0;
+		}
+		log_debug("monitor", "watch task %s", name);
+		events_load(namespace, name, &task->events);
+		monitor_register(args, task);
+		monitor_oom_takeover(namespace, task);
+		TAILQ_INSERT_HEAD(&args->tasks, task, next);
+	}
+	task->valid = 1;
+	return 0;
+}
+
+/**
+ * Refresh the list of watched tasks.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+monitor_refresh(const char *namespace, struct monitor_args *args)
+{
+	struct watched_task *task, *task_next;
+	TAILQ_FOREACH(task, &args->tasks, next)
+	    task->valid = 0;
+
+	if (cg_iterate_tasks(namespace, one_task, args) == -1) {
+		log_warnx("monitor", "error while walking tasks");
+		return -1;
+	}
+
+	for (task = TAILQ_FIRST(&args->tasks);
+	     task != NULL;
+	     task = task_next) {
+		task_next = TAILQ_NEXT(task, next);
+		if (task->valid == 0) {
+			log_debug("monitor", "stop watching task %s", task->name);
+			TAILQ_REMOVE(&args->tasks, task, next);
+			cg_close(task->cg); /* Also removes fds from epoll */
+			free(task->name);
+			free(task);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Reap hooks which have finished.
+ */
+static void
+monitor_reap(struct monitor_args *args)
+{
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		struct watched_task *task;
+		TAILQ_FOREACH(task, &args->tasks, next)
+		    if (task->hook == pid) task->hook = 0;
+	}
+}
+
+static int done = 0;
+static void
+stop(int signum)
+{
+	done = 1;
+}
+
+int
+cmd_monitor(const char *namespace, int argc, char * const argv[])
+{
+	int ch, rc = -1;
+	char *end;
+	struct monitor_args args = { .epfd = -1, .threshold = 90 };
+	TAILQ_INIT(&args.tasks);
+
+	while ((ch = getopt(argc, argv, "hu:")) != -1) {
+		switch (ch) {
+		case 'h':
+			usage();
+			return 0;
+		case 'u':
+			args.threshold = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' ||
+			    args.threshold < 0 || args.threshold > 100) {
+				usage();
+				return -1;
+			}
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (!cg_exist_named_hierarchy(namespace)) {
+		log_warnx("monitor", "namespace %s should be created with init command",
+			namespace);
+		return -1;
+	}
+	if ((args.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		log_warn("monitor", "unable to create epoll instance");
+		return -1;
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	log_info("monitor", "monitor tasks in namespace %s", namespace);
+	while (!done) {
+		if (monitor_refresh(namespace, &args) == -1)
+			goto end;
+		monitor_reap(&args);
+
+		/* New tasks are discovered every second */
+		struct epoll_event events[64];
+		int n = epoll_wait(args.epfd, events,
+		    sizeof(events)/sizeof(events[0]), 1000);
+		if (n == -1 && errno != EINTR) {
+			log_warn("monitor", "unable to wait for events");
+			goto end;
+		}
+		for (int i = 0; i < n; i++) {
+			struct notification *notification = events[i].data.ptr;
+			struct watched_task *task = notification->task;
+			enum cg_memory_event event = notification->event;
+			if (task->gone) continue;
+			int count = cg_memory_notified(task->cg, event,
+			    events[i].events);
+			if (count == -1) {
+				/* Released (or broken), stop watching it on
+				 * next refresh */
+				log_debug("monitor", "stop notifications for "
+				    "task %s", task->name);
+				task->gone = 1;
+				continue;
+			}
+			if (count == 0) continue;
+			task->events.memory[event] += count;
+			switch (event) {
+			case CG_MEMORY_LOW:
+				log_debug("monitor", "low memory pressure for task %s",
+				    task->name);
+				break;
+			case CG_MEMORY_MEDIUM:
+				log_info("monitor", "medium memory pressure for task %s",
+				    task->name);
+				break;
+			case CG_MEMORY_CRITICAL:
+				log_warnx("monitor", "critical memory pressure for task %s",
+				    task->name);
+				monitor_hook(namespace, task);
+				break;
+			case CG_MEMORY_THRESHOLD:
+				log_info("monitor", "task %s is above %d%% of its "
+				    "memory limit", task->name, args.threshold);
+				break;
+			default:
+				log_warnx("monitor", "task %s is out of memory",
+				    task->name);
+				monitor_oom(namespace, task);
+				break;
+			}
+			events_save(namespace, task->name, &task->events);
+		}
+	}
+	rc = 0;
+
+end:
+	while (!TAILQ_EMPTY(&args.tasks)) {
+		struct watched_task *task = TAILQ_FIRST(&args.tasks);
+		TAILQ_REMOVE(&args.tasks, task, next);
+		monitor_oom_release(task);
+		cg_close(task->cg);
+		free(task->name);
+		free(task);
+	}
+	close(args.epfd);
+	return rc;
+}
@@ -0,0 +1,136 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vincent.bernat@dailymotion.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "lanco.h"
+
+#include <string.h>
+
+/*
+ * Set of PIDs. This is an open addressing hash table with linear probing
+ * stored in a single buffer. PID 0 is never a valid PID and marks a free
+ * slot. The table is grown when half full.
+ */
+
+#define PIDSET_MIN_SIZE 64
+
+static size_t
+pidset_hash(pid_t pid, size_t size)
+{
+	return ((uint32_t)pid * 2654435761U) & (size - 1);
+}
+
+/**
+ * Initialize an empty set of PIDs.
+ *
+ * @param set Set to initialize.
+ */
+void
+pidset_init(struct pidset *set)
+{
+	memset(set, 0, sizeof(*set));
+}
+
+/**
+ * Insert a PID without checking the size of the table.
+ *
+ * @return 1 if the PID was added, 0 if it was already present.
+ */
+static int
+pidset_insert(pid_t *pids, size_t size, pid_t pid)
+{
+	size_t i = pidset_hash(pid, size);
+	while (pids[i] != 0) {
+		if (pids[i] == pid) return 0;
+		i = (i + 1) & (size - 1);
+	}
+	pids[i] = pid;
+	return 1;
+}
+
+/**
+ * Grow the table of a set of PIDs.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int
+pidset_grow(struct pidset *set)
+{
+	size_t size = set->size?(set->size * 2):PIDSET_MIN_SIZE;
+	pid_t *pids = calloc(size, sizeof(pid_t));
+	if (pids == NULL) {
+		log_warn("pidset", "unable to allocate memory for PID set");
+		return -1;
+	}
+	for (size_t i = 0; i < set->size; i++)
+		if (set->pids[i] != 0)
+			pidset_insert(pids, size, set->pids[i]);
+	free(set->pids);
+	set->pids = pids;
+	set->size = size;
+	return 0;
+}
+
+/**
+ * Add a PID to a set.
+ *
+ * @param set Set of PIDs.
+ * @param pid PID to add.
+ * @return 1 if the PID was added, 0 if it was already present, -1 on error.
+ */
+int
+pidset_add(struct pidset *set, pid_t pid)
+{
+	if (pid <= 0) return 0;
+	if ((set->count + 1) * 2 > set->size &&
+	    pidset_grow(set) == -1)
+		return -1;
+	if (!pidset_insert(set->pids, set->size, pid))
+		return 0;
+	set->count++;
+	return 1;
+}
+
+/**
+ * Check if a PID is in a set.
+ *
+ * @param set Set of PIDs.
+ * @param pid PID to look for.
+ * @return 1 if the PID is present, 0 otherwise.
+ */
+int
+pidset_contains(const struct pidset *set, pid_t pid)
+{
+	if (pid <= 0 || set->size == 0) return 0;
+	size_t i = pidset_hash(pid, set->size);
+	while (set->pids[i] != 0) {
+		if (set->pids[i] == pid) return 1;
+		i = (i + 1) & (set->size - 1);
+	}
+	return 0;
+}
+
+/**
+ * Release memory used by a set of PIDs. The set is empty after this call.
+ *
+ * @param set Set of PIDs.
+ */
+void
+pidset_free(struct pidset *set)
+{
+	free(set->pids);
+	pidset_init(set);
+}
@@ -39,27 +39,47 @@ usage(void)
 	fprintf(stderr, "-L         force logging to a logfile.\n");
 	fprintf(stderr, "-l logfile log output to the following file.\n");
 	fprintf(stderr, "-c command execute a command when the task exits.\n");
+	fprintf(stderr, "-p command execute a command on critical memory pressure.\n");
+	fprintf(stderr, "-o policy  handle OOM with kill, stop or raise:STEP.\n");
+	fprintf(stderr, "-m limit   limit memory usage (in bytes).\n");
+	fprintf(stderr, "-C cores   limit CPU usage (in number of CPUs).\n");
+	fprintf(stderr, "-W shares  relative CPU weight (default: 1024).\n");
+	fprintf(stderr, "-P cpus, --cpus cpus\n");
+	fprintf(stderr, "           restrict to the given CPUs (like 0-3,8).\n");
+	fprintf(stderr, "-N nodes, --mems nodes\n");
+	fprintf(stderr, "           restrict to the given memory nodes.\n");
+	fprintf(stderr, "--max-procs count\n");
+	fprintf(stderr, "           limit the number of processes and threads.\n");
+	fprintf(stderr, "--io-weight weight\n");
+	fprintf(stderr, "           relative block I/O weight.\n");
+	fprintf(stderr, "--read-bps device:bytes, --write-bps device:bytes\n");
+	fprintf(stderr, "--read-iops device:ops, --write-iops device:ops\n");
+	fprintf(stderr, "           throttle block I/O on a device (like 8:0 or /dev/sda).\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "see manual page lanco(8) for more information\n");
 }
 
 /**
- * Register a command to be run when the task exits. Only one such command can
- * be registered. This is done by creating a file
- * /var/run/lanco-XXXX/task-exit-XXXXX containing the command. The release agent
- * will execute it.
+ * Register a command to be run when the task exits or on critical memory
+ * pressure, or a policy to handle OOM. Only one command of each kind can be
+ * registered. This is done by creating a file
+ * /var/run/lanco-XXXX/task-KIND-XXXXX containing the command. The release
+ * agent will execute the exit command. The monitor command will execute the
+ * pressure command and apply the OOM policy.
  *
  * @param namespace Namespace.
  * @param task      Task name.
+ * @param kind      Kind of command ("exit", "pressure" or "oom").
  * @param command   Command to execute or NULL if no command
  * @return 0 on success, -1 on error.
  */
 static int
-register_command(const char *namespace, const char *task, const char *command)
+register_command(const char *namespace, const char *task, const char *kind,
+    const char *command)
 {
 	char *path = NULL;
-	if (asprintf(&path, RUNPREFIX "/lanco-%s/task-exit-%s",
-		namespace, task) == -1) {
+	if (asprintf(&path, RUNPREFIX "/lanco-%s/task-%s-%s",
+		namespace, kind, task) == -1) {
 		log_warn("run", "unable to allocate memory for new command");
 		return -1;
 	}
@@ -71,7 +91,12 @@ register_command(const char *namespace, const char *task, const char *command)
 	}
 
 	if (command) {
-		log_debug("run", "register new command for task %s", task);
+		if (cg_unified() && !strcmp(kind, "exit"))
+			log_warnx("run", "no release agent with cgroups v2, "
+			    "command for task %s will only run on explicit release",
+			    task);
+		log_debug("run", "register new %s command for task %s",
+		    kind, task);
 		FILE *fcommand = fopen(path, "w");
 		if (fcommand == NULL) {
 			log_warn("run", "unable to create file %s", path);
@@ -85,20 +110,102 @@ register_command(const char *namespace, const char *task, const char *command)
 	return 0;
 }
 
+struct io_limit {
+	enum cg_io_limit limit;	/* What to limit */
+	dev_t device;		/* Device to throttle */
+	uint64_t value;		/* Maximum per second */
+};
+
+/**
+ * Parse a block I/O limit and append it to a list of limits.
+ *
+ * @param limit  What to limit.
+ * @param spec   Limit as "device:value".
+ * @param limits List of limits to append to.
+ * @param count  Number of limits in the list.
+ * @return 0 on success, -1 on error
+ */
+static int
+parse_io_limit(enum cg_io_limit limit, const char *spec,
+    struct io_limit **limits, size_t *count)
+{
+	char *end;
+	char *device = strdup(spec);
+	char *value = device?strrchr(device, ':'):NULL;
+	if (value == NULL) {
+		log_warnx("run", "block I/O limit should be device:value");
+		free(device);
+		return -1;
+	}
+	*value++ = '\0';
+	struct io_limit *more = realloc(*limits,
+	    (*count + 1) * sizeof(struct io_limit));
+	if (more == NULL) {
+		log_warn("run", "unable to allocate memory for block I/O limit");
+		free(device);
+		return -1;
+	}
+	*limits = more;
+	more[*count].limit = limit;
+	more[*count].value = strtoull(value, &end, 10);
+	if (*value == '\0' || *end != '\0') {
+		log_warnx("run", "invalid block I/O limit %s", value);
+		free(device);
+		return -1;
+	}
+	if (utils_parse_device(device, &more[*count].device) == -1) {
+		free(device);
+		return -1;
+	}
+	free(device);
+	(*count)++;
+	return 0;
+}
+
 int
 cmd_run(const char *namespace, int argc, char * const argv[])
 {
 	int ch;
 	int background = 1;
 	long long unsigned memory = 0;
+	double cores = 0;
+	long shares = 0;
+	char *cpus = NULL;
+	char *mems = NULL;
+	long io_weight = 0;
+	long long max_procs = 0;
+	struct io_limit *io_limits = NULL;
+	size_t io_count = 0;
+	struct cg_handle *h = NULL;
+	enum {
+		OPT_MAX_PROCS = 256,
+		OPT_IO_WEIGHT,
+		OPT_IO_LIMIT		/* Followed by each cg_io_limit */
+	};
+	static struct option long_options[] = {
+		{ "cpus", required_argument, 0, 'P' },
+		{ "mems", required_argument, 0, 'N' },
+		{ "max-procs", required_argument, 0, OPT_MAX_PROCS },
+		{ "io-weight", required_argument, 0, OPT_IO_WEIGHT },
+		{ "read-bps", required_argument, 0, OPT_IO_LIMIT + CG_IO_READ_BPS },
+		{ "write-bps", required_argument, 0, OPT_IO_LIMIT + CG_IO_WRITE_BPS },
+		{ "read-iops", required_argument, 0, OPT_IO_LIMIT + CG_IO_READ_IOPS },
+		{ "write-iops", required_argument, 0, OPT_IO_LIMIT + CG_IO_WRITE_IOPS },
+		{ 0 }
+	};
 	char *logfile = NULL;
 	char *command = NULL;
+	char *pressure = NULL;
+	char *oom = NULL;
+	struct oom_policy policy;
 	char *end;
 
-	while ((ch = getopt(argc, argv, "hLl:fc:m:")) != -1) {
+	while ((ch = getopt_long(argc, argv, "hLl:fc:p:o:m:C:W:P:N:",
+		    long_options, NULL)) != -1) {
 		switch (ch) {
 		case 'h':
 			usage();
+			free(io_limits);
 			return 0;
 		case 'f':
 			background = 0;
@@ -112,29 +219,81 @@ cmd_run(const char *namespace, int argc, char * const argv[])
 		case 'c':
 			command = optarg;
 			break;
+		case 'p':
+			pressure = optarg;
+			break;
+		case 'o':
+			if (events_parse_oom_policy(optarg, &policy) == -1) {
+				usage();
+				goto error;
+			}
+			oom = optarg;
+			break;
 		case 'm':
 			memory = strtoll(optarg, &end, 10);
 			if (*end != '\0') {
 				usage();
-				return -1;
+				goto error;
+			}
+			break;
+		case 'C':
+			cores = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' || cores <= 0) {
+				usage();
+				goto error;
+			}
+			break;
+		case 'P':
+			cpus = optarg;
+			break;
+		case 'N':
+			mems = optarg;
+			break;
+		case OPT_MAX_PROCS:
+			max_procs = strtoll(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || max_procs <= 0) {
+				usage();
+				goto error;
+			}
+			break;
+		case OPT_IO_WEIGHT:
+			io_weight = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || io_weight <= 0) {
+				usage();
+				goto error;
+			}
+			break;
+		case OPT_IO_LIMIT + CG_IO_READ_BPS:
+		case OPT_IO_LIMIT + CG_IO_WRITE_BPS:
+		case OPT_IO_LIMIT + CG_IO_READ_IOPS:
+		case OPT_IO_LIMIT + CG_IO_WRITE_IOPS:
+			if (parse_io_limit(ch - OPT_IO_LIMIT, optarg,
+				&io_limits, &io_count) == -1)
+				goto error;
+			break;
+		case 'W':
+			shares = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || shares <= 0) {
+				usage();
+				goto error;
 			}
 			break;
 		default:
 			usage();
-			return -1;
+			goto error;
 		}
 	}
 
 	/* task and command */
 	if (optind > argc - 2) {
 		usage();
-		return -1;
+		goto error;
 	}
 
 	const char *task = argv[optind++];
 	if (!utils_is_valid_name(task)) {
 		log_warnx("run", "task should be an alphanumeric ASCII string");
-		return -1;
+		goto error;
 	}
 
 	argc -= optind;
@@ -144,27 +303,76 @@ cmd_run(const char *namespace, int argc, char * const argv[])
 	if (!cg_exist_named_hierarchy(namespace)) {
 		log_warnx("run", "namespace %s should be created with init command",
 			namespace);
-		return -1;
+		goto error;
 	}
-	if (cg_exist_task(namespace, task, NULL)) {
+	if (cg_exist_task(namespace, task)) {
 		log_warnx("run", "task %s is already running", task);
-		return -1;
+		goto error;
 	}
 
 	log_debug("run", "creating sub-cgroup for task %s", task);
 	if (cg_create_task(namespace, task)) {
 		log_warnx("run", "unable to create sub-cgroup for task %s", task);
-		return -1;
+		goto error;
+	}
+	if ((h = cg_open(namespace, task)) == NULL) {
+		log_warnx("run", "unable to open sub-cgroup for task %s", task);
+		goto error;
 	}
-	if (memory > 0 && cg_memory_limit(namespace, task, memory)) {
+	if (memory > 0 && cg_memory_limit(h, memory)) {
 		log_warnx("run", "unable to set memory limit for task %s", task);
-		return -1;
+		goto error;
+	}
+	if (cores > 0 && cg_cpu_limit(h, cores)) {
+		log_warnx("run", "unable to set CPU limit for task %s", task);
+		goto error;
+	}
+	if (shares > 0 && cg_cpu_shares(h, shares)) {
+		log_warnx("run", "unable to set CPU shares for task %s", task);
+		goto error;
+	}
+	if ((cpus || mems) && cg_cpuset(h, cpus, mems)) {
+		log_warnx("run", "unable to restrict CPUs or memory nodes for "
+		    "task %s", task);
+		goto error;
+	}
+	if (max_procs > 0 && cg_pids_max(h, max_procs)) {
+		log_warnx("run", "unable to limit number of processes for task %s",
+		    task);
+		goto error;
 	}
+	if (io_weight > 0 && cg_io_weight(h, io_weight)) {
+		log_warnx("run", "unable to set block I/O weight for task %s",
+		    task);
+		goto error;
+	}
+	for (size_t i = 0; i < io_count; i++) {
+		if (cg_io_limit(h, io_limits[i].limit,
+			io_limits[i].device, io_limits[i].value) == -1) {
+			log_warnx("run", "unable to throttle block I/O for task %s",
+			    task);
+			goto error;
+		}
+	}
+	/* The OOM killer is only disabled by monitor once it watches the
+	 * task. Until then, keep the kernel one. */
+	if (oom && cg_memory_oom_disable(h, 0) == -1) {
+		log_warnx("run", "unable to use an OOM policy for task %s", task);
+		goto error;
+	}
+	free(io_limits);
+	cg_close(h);
 
-	if (register_command(namespace, task, command) == -1) {
+	if (register_command(namespace, task, "exit", command) == -1 ||
+	    register_command(namespace, task, "pressure", pressure) == -1 ||
+	    register_command(namespace, task, "oom", oom) == -1) {
 		log_warnx("run", "unable to register command for task %s", task);
 		return -1;
 	}
+	if (events_reset(namespace, task) == -1) {
+		log_warnx("run", "unable to reset events for task %s", task);
+		return -1;
+	}
 
 	/* Redirect output */
 	if (logfile && strlen(logfile)) logfile = strdup(logfile);
@@ -197,4 +405,9 @@ cmd_run(const char *namespace, int argc, char * const argv[])
 	}
 
 	return 0;
+
+error:
+	free(io_limits);
+	if (h) cg_close(h);
+	return -1;
 }
@@ -21,91 +21,410 @@
 #include <getopt.h>
 #include <string.h>
 #include <signal.h>
+#include <strings.h>
+#include <fnmatch.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
 
 extern const char *__progname;
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s <namespace> stop task\n",
+	fprintf(stderr, "Usage: %s <namespace> stop [OPTIONS ...] task ...\n",
 		__progname);
 	fprintf(stderr, "Version: %s\n", PACKAGE_STRING);
 	fprintf(stderr, "\n");
+	fprintf(stderr, "-a, --all    stop all tasks.\n");
+	fprintf(stderr, "-s sequence  signals to send and time to wait (in ms).\n");
+	fprintf(stderr, "             default: TERM:20000,TERM:10000,KILL:5000\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "see manual page lanco(8) for more information\n");
 }
 
 struct sequence {
 	int signal;		/* Signal to send */
-	int wait;		/* How many time to wait for */
+	int wait;		/* How many milliseconds to wait for */
 };
 
 /**
  * Signals to stop a task.
  */
 static struct sequence stop[] = {
-	{ SIGTERM, 20 },
-	{ SIGTERM, 10 },
-	{ SIGKILL, 5 },
+	{ SIGTERM, 20000 },
+	{ SIGTERM, 10000 },
+	{ SIGKILL, 5000 },
 	{ 0 }
 };
 
+static struct {
+	const char *name;
+	int signal;
+} signals[] = {
+	{ "HUP",  SIGHUP },
+	{ "INT",  SIGINT },
+	{ "QUIT", SIGQUIT },
+	{ "ABRT", SIGABRT },
+	{ "KILL", SIGKILL },
+	{ "USR1", SIGUSR1 },
+	{ "USR2", SIGUSR2 },
+	{ "ALRM", SIGALRM },
+	{ "TERM", SIGTERM },
+	{ "CONT", SIGCONT },
+	{ "STOP", SIGSTOP },
+	{ NULL }
+};
+
+/**
+ * Parse a signal name or number.
+ *
+ * @param name Signal name (with or without "SIG") or number.
+ * @return the signal number or -1 if unknown
+ */
+static int
+parse_signal(const char *name)
+{
+	char *end;
+	long signal = strtol(name, &end, 10);
+	if (*name != '\0' && *end == '\0')
+		return (signal > 0 && signal < NSIG)?signal:-1;
+	if (!strncasecmp(name, "SIG", 3)) name += 3;
+	for (int i = 0; signals[i].name; i++)
+		if (!strcasecmp(signals[i].name, name))
+			return signals[i].signal;
+	return -1;
+}
+
+/**
+ * Parse a sequence of signals.
+ *
+ * A sequence looks like "TERM:2000,KILL:500": a signal and the time to wait
+ * for the task to stop, in milliseconds.
+ *
+ * @param spec Sequence to parse.
+ * @return an array terminated by a null signal or NULL on error
+ */
+static struct sequence *
+parse_sequence(const char *spec)
+{
+	char *copy = strdup(spec);
+	struct sequence *sequence = calloc(strlen(spec) + 1,
+	    sizeof(struct sequence));
+	if (copy == NULL || sequence == NULL) {
+		log_warn("stop", "unable to allocate memory for signal sequence");
+		goto error;
+	}
+
+	int n = 0;
+	for (char *item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+		char *wait = strchr(item, ':');
+		char *end;
+		if (wait == NULL) {
+			log_warnx("stop", "no wait time for signal %s", item);
+			goto error;
+		}
+		*wait++ = '\0';
+		if ((sequence[n].signal = parse_signal(item)) == -1) {
+			log_warnx("stop", "unknown signal %s", item);
+			goto error;
+		}
+		sequence[n].wait = strtol(wait, &end, 10);
+		if (*wait == '\0' || *end != '\0' || sequence[n].wait < 0) {
+			log_warnx("stop", "invalid wait time %s", wait);
+			goto error;
+		}
+		n++;
+	}
+	if (n == 0) {
+		log_warnx("stop", "empty signal sequence");
+		goto error;
+	}
+	free(copy);
+	return sequence;
+
+error:
+	free(copy);
+	free(sequence);
+	return NULL;
+}
+
+/**
+ * A task being stopped.
+ */
+struct stopping {
+	char *name;		/* Task name */
+	struct cg_handle *h;	/* Task handle */
+	struct sequence *step;	/* Current step of the sequence */
+	int64_t deadline;	/* When to go to the next step (in ms) */
+	int state;		/* 0: stopping, 1: stopped, -1: failed */
+};
+
+struct stop_tasks {
+	const char *namespace;	/* Namespace of the tasks */
+	struct stopping *tasks;	/* Tasks to stop */
+	size_t count;		/* Number of tasks */
+	const char *pattern;	/* Pattern to match or NULL for all tasks */
+	int matched;		/* Number of tasks matching the pattern */
+};
+
+/**
+ * Get current monotonic time in milliseconds.
+ */
+static int64_t
+stop_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Add a task to the list of tasks to stop, unless already present.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+stop_add(struct stop_tasks *tasks, const char *task)
+{
+	for (size_t i = 0; i < tasks->count; i++)
+		if (!strcmp(tasks->tasks[i].name, task)) return 0;
+	struct stopping *more = realloc(tasks->tasks,
+	    (tasks->count + 1) * sizeof(struct stopping));
+	if (more == NULL) {
+		log_warn("stop", "unable to allocate memory for task %s", task);
+		return -1;
+	}
+	tasks->tasks = more;
+	memset(&more[tasks->count], 0, sizeof(struct stopping));
+	if ((more[tasks->count].name = strdup(task)) == NULL) {
+		log_warn("stop", "unable to allocate memory for task %s", task);
+		return -1;
+	}
+	tasks->count++;
+	return 0;
+}
+
+static int
+stop_match(const char *namespace, const char *task, void *arg)
+{
+	struct stop_tasks *tasks = arg;
+	if (tasks->pattern && fnmatch(tasks->pattern, task, 0) != 0)
+		return 0;
+	tasks->matched++;
+	return stop_add(tasks, task);
+}
+
+/**
+ * Send the current signal of the sequence to a task.
+ *
+ * @param task Task to signal.
+ * @param now  Current time in milliseconds.
+ */
+static void
+stop_signal(struct stopping *task, int64_t now)
+{
+	if (task->step->signal <= 0) {
+		log_warnx("stop", "unable to stop task %s", task->name);
+		task->state = -1;
+		return;
+	}
+	log_debug("stop", "send signal %d to task %s",
+	    task->step->signal, task->name);
+	if (cg_kill_task(task->h, task->step->signal) == -1) {
+		log_warnx("stop", "unable to stop task %s", task->name);
+		task->state = -1;
+		return;
+	}
+	task->deadline = now + task->step->wait;
+}
+
+/**
+ * Check if a task has vanished and mark it as stopped.
+ *
+ * @return 1 if the task is stopped, 0 otherwise
+ */
+static int
+stop_check(int epfd, struct stopping *task)
+{
+	if (!cg_watch_events(task->h)) return 0;
+	log_debug("stop", "task %s does not exist anymore", task->name);
+	log_info("stop", "task %s has been terminated successfully",
+	    task->name);
+	int fd = cg_watch_task(task->h);
+	if (fd != -1) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	task->state = 1;
+	return 1;
+}
+
+/**
+ * Stop several tasks at once.
+ *
+ * All tasks are signalled in one pass and we wait for all of them in a
+ * single event loop. Each task goes through the signal sequence at its own
+ * pace. As a safety net, tasks are checked every second.
+ *
+ * @return 0 if all tasks were stopped, -1 otherwise
+ */
+static int
+stop_tasks(struct stop_tasks *tasks, struct sequence *sequence)
+{
+	int rc = -1;
+	size_t pending = 0;
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		log_warn("stop", "unable to create epoll instance");
+
+	int64_t now = stop_now();
+	for (size_t i = 0; i < tasks->count; i++) {
+		struct stopping *task = &tasks->tasks[i];
+		task->h = cg_open(tasks->namespace, task->name);
+		if (task->h == NULL || !cg_valid(task->h)) {
+			log_warnx("stop", "task %s is not running", task->name);
+			task->state = -1;
+			continue;
+		}
+		int fd = cg_watch_task(task->h);
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.ptr = task
+		};
+		if (epfd != -1 && fd != -1 &&
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+			log_warn("stop", "unable to watch task %s", task->name);
+		task->step = sequence;
+		stop_signal(task, now);
+		if (task->state == 0) pending++;
+	}
+
+	while (pending > 0) {
+		/* Wait until the next deadline, at most one second */
+		int64_t timeout = 1000;
+		for (size_t i = 0; i < tasks->count; i++) {
+			struct stopping *task = &tasks->tasks[i];
+			if (task->state == 0 && task->deadline - now < timeout)
+				timeout = task->deadline - now;
+		}
+		if (timeout < 0) timeout = 0;
+
+		struct epoll_event events[64];
+		int n = 0;
+		if (epfd == -1)
+			poll(NULL, 0, timeout);
+		else
+			n = epoll_wait(epfd, events,
+			    sizeof(events)/sizeof(events[0]), timeout);
+		if (n == -1 && errno != EINTR) {
+			log_warn("stop", "unable to wait for tasks");
+			goto end;
+		}
+		for (int i = 0; i < n; i++) {
+			struct stopping *task = events[i].data.ptr;
+			if (task->state == 0 && stop_check(epfd, task))
+				pending--;
+		}
+
+		now = stop_now();
+		for (size_t i = 0; i < tasks->count; i++) {
+			struct stopping *task = &tasks->tasks[i];
+			if (task->state != 0) continue;
+			if (n <= 0 || task->deadline <= now) {
+				/* Safety net or deadline reached */
+				if (stop_check(epfd, task)) {
+					pending--;
+					continue;
+				}
+			}
+			if (task->deadline > now) continue;
+			task->step++;
+			stop_signal(task, now);
+			if (task->state != 0) pending--;
+		}
+	}
+
+	rc = 0;
+	for (size_t i = 0; i < tasks->count; i++)
+		if (tasks->tasks[i].state != 1) rc = -1;
+end:
+	if (epfd != -1) close(epfd);
+	return rc;
+}
+
 int
 cmd_stop(const char *namespace, int argc, char * const argv[])
 {
-	int ch;
+	int ch, rc = -1, all = 0;
+	struct sequence *sequence = NULL;
+	struct stop_tasks tasks = { .namespace = namespace };
+	static struct option long_options[] = {
+		{ "all", no_argument, 0, 'a' },
+		{ 0 }
+	};
 
-	while ((ch = getopt(argc, argv, "h")) != -1) {
+	while ((ch = getopt_long(argc, argv, "has:", long_options, NULL)) != -1) {
 		switch (ch) {
 		case 'h':
 			usage();
 			return 0;
+		case 'a':
+			all = 1;
+			break;
+		case 's':
+			free(sequence);
+			if ((sequence = parse_sequence(optarg)) == NULL)
+				return -1;
+			break;
 		default:
 			usage();
+			free(sequence);
 			return -1;
 		}
 	}
 
-	if (optind > argc - 1) {
+	if (!all == (optind == argc)) {
 		usage();
+		free(sequence);
 		return -1;
 	}
 
-	const char *task = argv[optind++];
-	if (!utils_is_valid_name(task)) {
-		log_warnx("stop", "task should be an alphanumeric ASCII string");
-		return -1;
-	}
-	ino_t inode = 0;
-	if (!cg_exist_task(namespace, task, &inode)) {
-		log_warnx("stop", "task %s is not running", task);
-		return -1;
+	if (all) {
+		if (cg_iterate_tasks(namespace, stop_match, &tasks) == -1)
+			goto end;
+		if (tasks.count == 0) {
+			log_info("stop", "no task running in namespace %s",
+			    namespace);
+			rc = 0;
+			goto end;
+		}
 	}
-
-	int stopped = 0;
-	for (struct sequence *i = stop; i->signal > 0; i++) {
-		log_debug("stop", "send signal %d to task %s", i->signal, task);
-		if (cg_kill_task(namespace, task, inode, i->signal) == -1) {
-			log_warnx("stop", "unable to stop task %s", task);
-			return -1;
+	for (int i = optind; i < argc; i++) {
+		const char *task = argv[i];
+		if (strpbrk(task, "*?[")) {
+			tasks.pattern = task;
+			tasks.matched = 0;
+			if (cg_iterate_tasks(namespace, stop_match, &tasks) == -1)
+				goto end;
+			if (tasks.matched == 0)
+				log_warnx("stop", "no task matching %s", task);
+			continue;
 		}
-
-		int wait = i->wait;
-		while (wait-- > 0) {
-			sleep(1);
-			if (!cg_exist_task(namespace, task, &inode)) {
-				log_debug("stop", "task %s does not exist anymore",
-				    task);
-				stopped++;
-				break;
-			}
+		if (!utils_is_valid_name(task)) {
+			log_warnx("stop", "task should be an alphanumeric ASCII string");
+			goto end;
 		}
-		if (stopped) break;
-	}
-	if (!stopped) {
-		log_warnx("stop", "unable to stop task %s", task);
-		return -1;
+		if (stop_add(&tasks, task) == -1) goto end;
 	}
+	if (tasks.count == 0) goto end;
 
-	log_info("stop", "task %s has been terminated successfully", task);
-	return 0;
+	rc = stop_tasks(&tasks, sequence?sequence:stop);
+
+end:
+	for (size_t i = 0; i < tasks.count; i++) {
+		cg_close(tasks.tasks[i].h);
+		free(tasks.tasks[i].name);
+	}
+	free(tasks.tasks);
+	free(sequence);
+	return rc;
 }
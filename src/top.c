@@ -24,30 +24,405 @@
 #include <curses.h>
 #include <syslog.h>
 #include <signal.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/queue.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 extern const char *__progname;
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s <namespace> top\n",
+	fprintf(stderr, "Usage: %s <namespace> top [OPTIONS ...]\n",
 		__progname);
 	fprintf(stderr, "Version: %s\n", PACKAGE_STRING);
 	fprintf(stderr, "\n");
+	fprintf(stderr, "-i secs   refresh interval in seconds (default: 1).\n");
+	fprintf(stderr, "-b        batch mode: one line per task and per interval.\n");
+	fprintf(stderr, "-n count  in batch mode, stop after count intervals.\n");
+	fprintf(stderr, "-j        in batch mode, output JSON objects.\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "see manual page lanco(8) for more information\n");
 }
 
+/* Detailed CPU usage */
+struct cpu_detail {
+	int ncpus;		/* Number of CPUs in usage, 0 if not available */
+	uint64_t *usage;	/* Usage of each CPU */
+	double *percent;	/* Usage of each CPU in percent */
+	int has_stat;		/* Is user/system split available? */
+	uint64_t user;		/* Time spent in user mode */
+	uint64_t system;	/* Time spent in kernel mode */
+	double user_percent;	/* User mode in percent */
+	double system_percent;	/* Kernel mode in percent */
+};
+
+/**
+ * Refresh detailed CPU usage.
+ *
+ * @param h       Handle to the namespace or the task.
+ * @param cpu     Detailed CPU usage to refresh.
+ * @param elapsed Elapsed time since last refresh in nanoseconds or 0.
+ */
+static void
+cpu_detail_refresh(struct cg_handle *h, struct cpu_detail *cpu, double elapsed)
+{
+	static int max = 0;
+	static uint64_t *usage = NULL;
+	static int nbcpu = 0;
+	if (max == 0) {
+		max = sysconf(_SC_NPROCESSORS_CONF);
+		nbcpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (max <= 0) max = 1;
+		if (nbcpu <= 0) nbcpu = 1;
+		if ((usage = calloc(max, sizeof(uint64_t))) == NULL) max = -1;
+	}
+	if (max <= 0) return;
+
+	int n = cg_cpu_percpu(h, usage, max);
+	if (n > 0 && n != cpu->ncpus) {
+		/* First time or CPU hotplug */
+		free(cpu->usage);
+		free(cpu->percent);
+		cpu->usage = calloc(n, sizeof(uint64_t));
+		cpu->percent = calloc(n, sizeof(double));
+		cpu->ncpus = (cpu->usage && cpu->percent)?n:0;
+		elapsed = 0;
+	} else if (n <= 0)
+		cpu->ncpus = 0;
+	for (int i = 0; i < cpu->ncpus; i++) {
+		cpu->percent[i] = (elapsed > 0 && usage[i] > cpu->usage[i])?
+		    (usage[i] - cpu->usage[i]) * 100. / elapsed:0;
+		cpu->usage[i] = usage[i];
+	}
+
+	uint64_t user = 0, system = 0;
+	int has_stat = (cg_cpu_stat(h, &user, &system) == 0);
+	if (has_stat && cpu->has_stat && elapsed > 0) {
+		cpu->user_percent = (user > cpu->user)?
+		    (user - cpu->user) * 100. / elapsed / nbcpu:0;
+		cpu->system_percent = (system > cpu->system)?
+		    (system - cpu->system) * 100. / elapsed / nbcpu:0;
+	} else
+		cpu->user_percent = cpu->system_percent = 0;
+	cpu->has_stat = has_stat;
+	cpu->user = user;
+	cpu->system = system;
+}
+
+static void
+cpu_detail_free(struct cpu_detail *cpu)
+{
+	free(cpu->usage);
+	free(cpu->percent);
+}
+
+/* A process (or a thread) of an expanded task */
+struct task_pid {
+	pid_t pid;		/* PID or thread ID */
+	struct proc_stat stat;	/* State and CPU time */
+	double cpu_percent;	/* CPU usage in percent */
+	uint64_t rss;		/* Resident memory, 0 for threads */
+	char *cmdline;		/* Command line or NULL */
+};
+
+/* Processes of an expanded task */
+struct pid_detail {
+	int threads;		/* List threads instead of processes? */
+	struct task_pid *pids;	/* Processes, sorted by PID */
+	size_t count;		/* Number of processes */
+	size_t size;		/* Allocated size of pids */
+	struct timespec ts;	/* Timestamp of last refresh */
+};
+
+static int
+pid_detail_visit(const char *namespace, const char *name, pid_t pid, void *arg)
+{
+	struct pid_detail *detail = arg;
+	if (detail->count >= detail->size) {
+		size_t size = detail->size?(detail->size * 2):16;
+		struct task_pid *pids = realloc(detail->pids,
+		    size * sizeof(struct task_pid));
+		if (pids == NULL) {
+			log_warn("top", "unable to allocate memory for processes");
+			return -1;
+		}
+		detail->pids = pids;
+		detail->size = size;
+	}
+	struct task_pid *p = &detail->pids[detail->count];
+	memset(p, 0, sizeof(*p));
+	p->pid = pid;
+	if (utils_proc_stat(pid, &p->stat) == -1) return 0; /* Vanished */
+	if (!detail->threads) p->rss = utils_rss(pid);
+	detail->count++;
+	return 0;
+}
+
+static int
+pid_compare(const void *a, const void *b)
+{
+	const struct task_pid *p1 = a, *p2 = b;
+	return (p1->pid > p2->pid) - (p1->pid < p2->pid);
+}
+
+static void
+pid_detail_free(struct pid_detail *detail)
+{
+	for (size_t i = 0; i < detail->count; i++)
+		free(detail->pids[i].cmdline);
+	free(detail->pids);
+	detail->pids = NULL;
+	detail->count = detail->size = 0;
+	memset(&detail->ts, 0, sizeof(struct timespec));
+}
+
+/**
+ * Refresh the processes of an expanded task.
+ *
+ * The new list is sorted by PID and merged with the previous one to get
+ * the CPU usage of each process since the last refresh.
+ *
+ * @param h      Handle to the task.
+ * @param detail Processes to refresh.
+ * @return 0 on success, -1 on error
+ */
+static int
+pid_detail_refresh(struct cg_handle *h, struct pid_detail *detail)
+{
+	static int nbcpu = 0;
+	if (nbcpu == 0) {
+		nbcpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nbcpu <= 0) nbcpu = 1;
+	}
+
+	struct pid_detail current = { .threads = detail->threads };
+	if (clock_gettime(CLOCK_MONOTONIC, &current.ts) == -1) {
+		log_warn("top", "unable to get current time");
+		return -1;
+	}
+	if (cg_iterate_pids(h, current.threads, pid_detail_visit, &current) == -1) {
+		free(current.pids);
+		return -1;
+	}
+	qsort(current.pids, current.count, sizeof(struct task_pid), pid_compare);
+
+	uint64_t elapsed = detail->ts.tv_sec?
+	    ((current.ts.tv_sec - detail->ts.tv_sec) * 1000000000ULL +
+		current.ts.tv_nsec - detail->ts.tv_nsec):0;
+	size_t j = 0;
+	for (size_t i = 0; i < current.count; i++) {
+		struct task_pid *p = &current.pids[i];
+		while (j < detail->count && detail->pids[j].pid < p->pid)
+			free(detail->pids[j++].cmdline);
+		if (j < detail->count && detail->pids[j].pid == p->pid) {
+			struct task_pid *old = &detail->pids[j++];
+			if (elapsed > 0 && p->stat.cpu > old->stat.cpu)
+				p->cpu_percent = (p->stat.cpu - old->stat.cpu) *
+				    100. / elapsed / nbcpu;
+			p->cmdline = old->cmdline;
+		} else if (!current.threads) {
+			char *cmdline = utils_cmdline(p->pid);
+			if (cmdline) p->cmdline = strdup(cmdline);
+		}
+	}
+	while (j < detail->count)
+		free(detail->pids[j++].cmdline);
+	free(detail->pids);
+	*detail = current;
+	return 0;
+}
+
 struct one_task {
 	TAILQ_ENTRY (one_task) next;
-	int valid;		/* Is the task still valid? */
-	char *name;		/* Task name */
-	unsigned nb;		/* Number of processes */
+	struct one_task *hnext;	/* Next task in bucket or next free entry */
+	uint32_t hash;		/* Hash of the name */
+	unsigned generation;	/* Last refresh where the task was seen */
+	char name[NAME_MAX + 1]; /* Task name */
+	struct cg_handle *cg;	/* Handle to the task cgroup */
+	unsigned nb;		/* Number of processes (or threads) */
+	int threads;		/* Does nb count threads? */
 	double cpu_percent;	/* cpu usage in percent */
 	uint64_t cpu_usage;	/* absolute CPU usage */
+	struct cpu_detail cpu;	/* Detailed CPU usage */
+	int has_memory;		/* Is memory accounting available? */
+	struct cg_memory_stat memory; /* Memory usage */
+	uint64_t mem_usage;	/* Memory usage, 0 if not available */
+	uint64_t mem_limit;	/* Memory limit, 0 if none */
+	struct task_events events; /* Events recorded by monitor */
+	struct events_stamp events_stamp; /* Stamp of the loaded events */
+	struct cg_memory_oom oom; /* OOM killer state */
+	int has_io;		/* Is block I/O accounting available? */
+	struct cg_io_stat io;	/* Block I/O usage */
+	double io_read;		/* Bytes read per second */
+	double io_write;	/* Bytes written per second */
+	double io_ops;		/* I/O operations per second */
+	int expanded;		/* Are processes of the task displayed? */
+	struct pid_detail detail; /* Processes of an expanded task */
 	struct timespec ts;	/* Timestamp of last refresh */
 };
 
+/*
+ * Table of tasks. Tasks are kept in a list in discovery order and indexed by
+ * name in a hash table with chaining. Entries are allocated by chunks and
+ * recycled through a free list. Tasks not seen during the last refresh are
+ * detected with a generation number.
+ */
+#define TASK_CHUNK 64
+struct task_chunk {
+	struct task_chunk *next;
+	struct one_task tasks[TASK_CHUNK];
+};
+struct task_table {
+	TAILQ_HEAD(, one_task) list; /* All tasks */
+	struct one_task **buckets; /* Hash table */
+	size_t size;		/* Number of buckets (power of 2) */
+	size_t count;		/* Number of tasks */
+	struct one_task *free;	/* Free entries */
+	struct task_chunk *chunks; /* Allocated chunks */
+	unsigned generation;	/* Current refresh */
+};
+
+static uint32_t
+table_hash(const char *name)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void
+table_init(struct task_table *table)
+{
+	memset(table, 0, sizeof(*table));
+	TAILQ_INIT(&table->list);
+}
+
+static struct one_task *
+table_lookup(struct task_table *table, const char *name, uint32_t hash)
+{
+	if (table->size == 0) return NULL;
+	struct one_task *task = table->buckets[hash & (table->size - 1)];
+	for (; task != NULL; task = task->hnext)
+		if (task->hash == hash && !strcmp(task->name, name)) break;
+	return task;
+}
+
+/**
+ * Grow the hash table to keep chains short.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+table_grow(struct task_table *table)
+{
+	size_t size = table->size?(table->size * 2):64;
+	struct one_task **buckets = calloc(size, sizeof(struct one_task *));
+	if (buckets == NULL) {
+		log_warn("top", "unable to allocate memory for tasks");
+		return -1;
+	}
+	struct one_task *task;
+	TAILQ_FOREACH(task, &table->list, next) {
+		struct one_task **bucket = &buckets[task->hash & (size - 1)];
+		task->hnext = *bucket;
+		*bucket = task;
+	}
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+	return 0;
+}
+
+/**
+ * Add a new task to the table.
+ *
+ * @return the new task or NULL on error
+ */
+static struct one_task *
+table_insert(struct task_table *table, const char *name, uint32_t hash)
+{
+	if (strlen(name) > NAME_MAX) return NULL;
+	if (table->count >= table->size && table_grow(table) == -1)
+		return NULL;
+	if (table->free == NULL) {
+		struct task_chunk *chunk = malloc(sizeof(struct task_chunk));
+		if (chunk == NULL) {
+			log_warn("top", "unable to allocate memory for tasks");
+			return NULL;
+		}
+		chunk->next = table->chunks;
+		table->chunks = chunk;
+		for (int i = 0; i < TASK_CHUNK; i++) {
+			chunk->tasks[i].hnext = table->free;
+			table->free = &chunk->tasks[i];
+		}
+	}
+	struct one_task *task = table->free;
+	table->free = task->hnext;
+	memset(task, 0, sizeof(*task));
+	strcpy(task->name, name);
+	task->hash = hash;
+	struct one_task **bucket = &table->buckets[hash & (table->size - 1)];
+	task->hnext = *bucket;
+	*bucket = task;
+	TAILQ_INSERT_TAIL(&table->list, task, next);
+	table->count++;
+	return task;
+}
+
+static void
+table_remove(struct task_table *table, struct one_task *task)
+{
+	struct one_task **prev = &table->buckets[task->hash & (table->size - 1)];
+	while (*prev != task) prev = &(*prev)->hnext;
+	*prev = task->hnext;
+	TAILQ_REMOVE(&table->list, task, next);
+	table->count--;
+	cg_close(task->cg);
+	cpu_detail_free(&task->cpu);
+	pid_detail_free(&task->detail);
+	task->hnext = table->free;
+	table->free = task;
+}
+
+/**
+ * Remove tasks not seen during the current refresh.
+ */
+static void
+table_sweep(struct task_table *table)
+{
+	struct one_task *task, *task_next;
+	for (task = TAILQ_FIRST(&table->list);
+	     task != NULL;
+	     task = task_next) {
+		task_next = TAILQ_NEXT(task, next);
+		if (task->generation != table->generation)
+			table_remove(table, task);
+	}
+}
+
+static void
+table_free(struct task_table *table)
+{
+	while (!TAILQ_EMPTY(&table->list))
+		table_remove(table, TAILQ_FIRST(&table->list));
+	while (table->chunks) {
+		struct task_chunk *chunk = table->chunks;
+		table->chunks = chunk->next;
+		free(chunk);
+	}
+	free(table->buckets);
+}
+
 static int
 one_pid(const char *namespace, const char *name, pid_t pid, void *arg)
 {
@@ -59,16 +434,21 @@ one_pid(const char *namespace, const char *name, pid_t pid, void *arg)
 static int
 one_task(const char *namespace, const char *name, void *arg)
 {
-	TAILQ_HEAD(, one_task) *tasks = arg;
-	struct one_task *task;
-	TAILQ_FOREACH(task, tasks, next)
-	    if (!strcmp(task->name, name)) break;
-	if (task == NULL) {
-		if ((task = malloc(sizeof(struct one_task))) == NULL) return 0;
-		task->name = strdup(name);
-		TAILQ_INSERT_TAIL(tasks, task, next);
-	}
-	task->valid = 1;
+	struct task_table *tasks = arg;
+	uint32_t hash = table_hash(name);
+	struct one_task *task = table_lookup(tasks, name, hash);
+	if (task == NULL &&
+	    (task = table_insert(tasks, name, hash)) == NULL) return 0;
+	if (task->cg && !cg_valid(task->cg)) {
+		/* The task has been restarted */
+		cg_close(task->cg);
+		task->cg = NULL;
+	}
+	if (task->cg == NULL) {
+		memset(&task->ts, 0, sizeof(struct timespec));
+		if ((task->cg = cg_open(namespace, name)) == NULL) return 0;
+	}
+	task->generation = tasks->generation;
 	task->nb = 0;
 
 	struct timespec ts;
@@ -83,7 +463,7 @@ one_task(const char *namespace, const char *name, void *arg)
 		if (nbcpu <= 0) nbcpu = 1;
 	}
 
-	uint64_t new_usage = cg_cpu_usage(namespace, name);
+	uint64_t new_usage = cg_cpu_usage(task->cg);
 	if (task->ts.tv_sec && new_usage > 0) {
 		uint64_t x, y;
 
@@ -99,15 +479,252 @@ one_task(const char *namespace, const char *name, void *arg)
 	} else
 		task->cpu_percent = 0;
 	task->cpu_usage = new_usage;
+	cpu_detail_refresh(task->cg, &task->cpu, task->ts.tv_sec?
+	    ((ts.tv_sec - task->ts.tv_sec) * 1e9 +
+		(ts.tv_nsec - task->ts.tv_nsec)):0);
+
+	struct cg_io_stat io;
+	int has_io = (cg_io_stat(task->cg, &io) == 0);
+	if (has_io && task->has_io && task->ts.tv_sec) {
+		double elapsed = (ts.tv_sec - task->ts.tv_sec) +
+		    (ts.tv_nsec - task->ts.tv_nsec) / 1e9;
+		task->io_read = (io.read_bytes - task->io.read_bytes) / elapsed;
+		task->io_write = (io.write_bytes - task->io.write_bytes) / elapsed;
+		task->io_ops = (io.read_ios + io.write_ios -
+		    task->io.read_ios - task->io.write_ios) / elapsed;
+	} else
+		task->io_read = task->io_write = task->io_ops = 0;
+	task->has_io = has_io;
+	task->io = io;
 	memcpy(&task->ts, &ts, sizeof(struct timespec));
 
-	if (cg_iterate_pids(namespace, name, one_pid, task) == -1) {
-		return -1;
+	task->has_memory = (cg_memory_stat(task->cg, &task->memory) == 0);
+	task->mem_usage = cg_memory_usage(task->cg);
+	task->mem_limit = task->mem_usage?cg_memory_get_limit(task->cg):0;
+	events_refresh(namespace, name, &task->events, &task->events_stamp);
+	cg_memory_oom(task->cg, &task->oom);
+
+	/* The pids controller gives the number of threads for free,
+	 * otherwise, we need to walk the processes */
+	uint64_t current;
+	if ((task->threads = (cg_pids_current(task->cg, &current) == 0)))
+		task->nb = current;
+	else if (cg_iterate_pids(task->cg, 0, one_pid, task) == -1) {
+		if (errno != ENOENT && errno != ENODEV)
+			return -1;
+		/* Vanished, removed on next refresh */
+	}
+
+	/* Processes are only sampled for expanded tasks */
+	if (task->expanded)
+		pid_detail_refresh(task->cg, &task->detail);
+
+	return 0;
+}
+
+/* Namespace-wide CPU usage */
+struct ns_cpu {
+	struct cg_handle *h;	/* Handle to the namespace */
+	uint64_t usage;		/* CPU usage at last refresh */
+	struct timespec ts;	/* Time of last refresh */
+	double percent;		/* CPU usage in percent, -1 if unknown */
+	struct cpu_detail cpu;	/* Detailed CPU usage */
+};
+
+/**
+ * Refresh namespace-wide CPU usage.
+ *
+ * The usage is computed against the time really elapsed since the
+ * previous refresh, not against the requested interval.
+ *
+ * @param namespace Namespace to refresh.
+ * @param ns        Namespace-wide CPU usage to refresh.
+ */
+static void
+ns_cpu_refresh(const char *namespace, struct ns_cpu *ns)
+{
+	static int nbcpu = 0;
+	if (nbcpu == 0) {
+		nbcpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nbcpu <= 0) nbcpu = 1;
+	}
+
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		log_warn("top", "unable to get current time");
+		return;
 	}
+	if (ns->h == NULL && (ns->h = cg_open(namespace, NULL)) == NULL)
+		return;
+
+	uint64_t usage = cg_cpu_usage(ns->h);
+	uint64_t x, y;
+	x = ((uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec) -
+	    ((uint64_t) ns->ts.tv_sec * 1000000000ULL + (uint64_t) ns->ts.tv_nsec);
+	y = usage - ns->usage;
+	cpu_detail_refresh(ns->h, &ns->cpu, ns->ts.tv_sec?x:0);
+	if (ns->ts.tv_sec && x > 0 && usage > 0)
+		ns->percent = (double) y * (double) 100. / (double) x / (double) nbcpu;
+	else
+		ns->percent = -1;
+	ns->usage = usage;
+	memcpy(&ns->ts, &now, sizeof(struct timespec));
+}
+
+static void
+ns_cpu_free(struct ns_cpu *ns)
+{
+	cpu_detail_free(&ns->cpu);
+	if (ns->h) cg_close(ns->h);
+}
 
+/* Sort order of tasks */
+enum sort_key {
+	SORT_CPU,		/* By CPU usage */
+	SORT_MEMORY,		/* By memory usage */
+	SORT_PROCS,		/* By number of processes */
+	SORT_NAME,		/* By name */
+	SORT_MAX
+};
+
+/* State of the display */
+struct display {
+	enum sort_key sort;	/* Sort order */
+	struct one_task **sorted; /* Tasks in display order */
+	size_t size;		/* Allocated size of sorted */
+	int first;		/* Index of the first displayed task */
+	int shown;		/* Number of displayed tasks */
+	int cursor;		/* Index of the selected task */
+	char selected[NAME_MAX + 1]; /* Name of the selected task */
+};
+
+static int
+sort_by_name(const void *a, const void *b)
+{
+	const struct one_task *t1 = *(struct one_task * const *)a;
+	const struct one_task *t2 = *(struct one_task * const *)b;
+	return strcmp(t1->name, t2->name);
+}
+
+static int
+sort_by_cpu(const void *a, const void *b)
+{
+	const struct one_task *t1 = *(struct one_task * const *)a;
+	const struct one_task *t2 = *(struct one_task * const *)b;
+	if (t1->cpu_percent != t2->cpu_percent)
+		return (t1->cpu_percent < t2->cpu_percent)?1:-1;
+	return sort_by_name(a, b);
+}
+
+static int
+sort_by_memory(const void *a, const void *b)
+{
+	const struct one_task *t1 = *(struct one_task * const *)a;
+	const struct one_task *t2 = *(struct one_task * const *)b;
+	if (t1->mem_usage != t2->mem_usage)
+		return (t1->mem_usage < t2->mem_usage)?1:-1;
+	return sort_by_name(a, b);
+}
+
+static int
+sort_by_procs(const void *a, const void *b)
+{
+	const struct one_task *t1 = *(struct one_task * const *)a;
+	const struct one_task *t2 = *(struct one_task * const *)b;
+	if (t1->nb != t2->nb)
+		return (t1->nb < t2->nb)?1:-1;
+	return sort_by_name(a, b);
+}
+
+static const struct {
+	const char *name;
+	int (*compare)(const void *, const void *);
+} sort_keys[SORT_MAX] = {
+	[SORT_CPU]    = { "cpu",    sort_by_cpu },
+	[SORT_MEMORY] = { "memory", sort_by_memory },
+	[SORT_PROCS]  = { "procs",  sort_by_procs },
+	[SORT_NAME]   = { "name",   sort_by_name },
+};
+
+/**
+ * Sort tasks in display order.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+display_sort(struct display *display, struct task_table *tasks)
+{
+	struct one_task *task;
+	if (display->size < tasks->count) {
+		size_t size = display->size?display->size:64;
+		while (size < tasks->count) size *= 2;
+		struct one_task **sorted = realloc(display->sorted,
+		    size * sizeof(struct one_task *));
+		if (sorted == NULL) {
+			log_warn("top", "unable to allocate memory for sorting");
+			return -1;
+		}
+		display->sorted = sorted;
+		display->size = size;
+	}
+	size_t i = 0;
+	TAILQ_FOREACH(task, &tasks->list, next)
+	    display->sorted[i++] = task;
+	qsort(display->sorted, tasks->count, sizeof(struct one_task *),
+	    sort_keys[display->sort].compare);
 	return 0;
 }
 
+/**
+ * Handle a keypress to change sort order, to move the selection or to
+ * expand the selected task.
+ *
+ * @return 1 if the display should be updated, 0 otherwise
+ */
+static int
+display_key(struct display *display, struct task_table *tasks, int key)
+{
+	int page = (display->shown > 1)?display->shown - 1:1;
+	struct one_task *task = NULL;
+	if (display->sorted &&
+	    display->cursor >= 0 && display->cursor < (int)tasks->count)
+		task = display->sorted[display->cursor];
+	switch (key) {
+	case 'c': display->sort = SORT_CPU; return 1;
+	case 'm': display->sort = SORT_MEMORY; return 1;
+	case 'p': display->sort = SORT_PROCS; return 1;
+	case 'n': display->sort = SORT_NAME; return 1;
+	case KEY_UP:    display->cursor--; break;
+	case KEY_DOWN:  display->cursor++; break;
+	case KEY_PPAGE: display->cursor -= page; display->first -= page; break;
+	case KEY_NPAGE: display->cursor += page; display->first += page; break;
+	case KEY_HOME:  display->cursor = 0; break;
+	case KEY_END:   display->cursor = tasks->count; break;
+	case KEY_ENTER: case '\n': case '\r': case ' ':
+		if (task == NULL) return 0;
+		if ((task->expanded = !task->expanded))
+			pid_detail_refresh(task->cg, &task->detail);
+		else
+			pid_detail_free(&task->detail);
+		return 1;
+	case 't':
+		if (task == NULL) return 0;
+		pid_detail_free(&task->detail);
+		task->detail.threads = !task->detail.threads || !task->expanded;
+		task->expanded = 1;
+		pid_detail_refresh(task->cg, &task->detail);
+		return 1;
+	default: return 0;
+	}
+	if (display->cursor > (int)tasks->count - 1)
+		display->cursor = tasks->count - 1;
+	if (display->cursor < 0) display->cursor = 0;
+	if (display->first < 0) display->first = 0;
+	if (display->sorted && tasks->count > 0)
+		strcpy(display->selected, display->sorted[display->cursor]->name);
+	return 1;
+}
+
 /* Logs handling in curses mode */
 static void
 curses_log(int severity, const char *msg, void *arg)
@@ -131,14 +748,94 @@ curses_log(int severity, const char *msg, void *arg)
 	wprintw(logs_win, "\n%s", prefix);
 	wattroff(logs_win, COLOR_PAIR(color) | A_BOLD);
 	wprintw(logs_win, " %s", msg);
-	wrefresh(logs_win);
+	wnoutrefresh(logs_win);
+}
+
+/* Windows in curses mode */
+static struct {
+	WINDOW *status;		/* Status bar */
+	WINDOW *main;		/* Tasks, as displayed on the terminal */
+	WINDOW *frame;		/* Off-screen pad where the next frame is drawn */
+	WINDOW *logs;		/* Logs or NULL if the terminal is too small */
+	int width;		/* Width of the terminal */
+	int rows;		/* Number of rows of the main window */
+	chtype *row[2];		/* Buffers to compare a row of each frame */
+} screen;
+
+/**
+ * Create windows to fit the terminal. This is done once and each time
+ * the terminal is resized.
+ */
+static void
+curses_layout(void)
+{
+	int height, width;
+	getmaxyx(stdscr, height, width);
+
+	if (screen.status) delwin(screen.status);
+	if (screen.main) delwin(screen.main);
+	if (screen.frame) delwin(screen.frame);
+	free(screen.row[0]);
+	free(screen.row[1]);
+	screen.width = width;
+	screen.rows = (height > 10)?(height - 10):(height - 2);
+	screen.status = newwin(1, width, 0, 0);
+	if (screen.status) wbkgd(screen.status, COLOR_PAIR(1));
+	screen.main = screen.frame = NULL;
+	if (screen.rows > 0 &&
+	    (screen.main = newwin(screen.rows, width, 2, 0)) != NULL)
+		screen.frame = newpad(screen.rows, width);
+	screen.row[0] = calloc(width + 1, sizeof(chtype));
+	screen.row[1] = calloc(width + 1, sizeof(chtype));
+
+	/* Logs are kept when the terminal is resized */
+	if (height > 10 && screen.logs == NULL) {
+		screen.logs = newwin(8, width, height - 8, 0);
+		if (screen.logs) scrollok(screen.logs, TRUE);
+	} else if (height > 10) {
+		wresize(screen.logs, 8, width);
+		mvwin(screen.logs, height - 8, 0);
+	} else if (screen.logs) {
+		delwin(screen.logs);
+		screen.logs = NULL;
+	}
+	log_register(curses_log, screen.logs);
+
+	/* Nothing is drawn on the standard screen, but it covers the
+	 * whole terminal: mark it as up-to-date once for all and repaint
+	 * everything. */
+	wnoutrefresh(stdscr);
+	clearok(curscr, TRUE);
+}
+
+/**
+ * Copy the rows of the new frame which differ from the displayed ones.
+ * Untouched rows are not even considered by the next doupdate().
+ */
+static void
+curses_frame(void)
+{
+	if (screen.row[0] == NULL || screen.row[1] == NULL) {
+		overwrite(screen.frame, screen.main);
+		return;
+	}
+	for (int y = 0; y < screen.rows; y++) {
+		mvwinchnstr(screen.frame, y, 0, screen.row[0], screen.width);
+		mvwinchnstr(screen.main, y, 0, screen.row[1], screen.width);
+		if (memcmp(screen.row[0], screen.row[1],
+			screen.width * sizeof(chtype)))
+			mvwaddchnstr(screen.main, y, 0, screen.row[0], screen.width);
+	}
 }
 
 static void
 curses_init(void)
 {
 	initscr();
+	cbreak();
 	noecho();
+	nodelay(stdscr, TRUE);
+	keypad(stdscr, TRUE);
 	start_color();
 	init_pair(1, COLOR_BLACK, COLOR_GREEN);
 	init_pair(2, COLOR_RED, COLOR_BLACK);
@@ -146,6 +843,7 @@ curses_init(void)
 	init_pair(4, COLOR_BLUE, COLOR_BLACK);
 	init_pair(5, COLOR_YELLOW, COLOR_BLACK);
 	init_pair(6, COLOR_CYAN, COLOR_BLACK);
+	curses_layout();
 }
 
 static void
@@ -171,50 +869,94 @@ curses_gauge(WINDOW *win, float percent, int width)
 	wattroff(win, A_BOLD | COLOR_PAIR(6));
 }
 
-static void
-curses_global_cpu(WINDOW *win, const char *namespace, int width)
+/* Per-CPU usage as a row of characters, returns 0 if nothing was drawn */
+static int
+curses_cpu_detail(WINDOW *win, struct cpu_detail *cpu, int width)
 {
-	static uint64_t cpu_usage = 0;
-	static struct timespec ts = {};
-
-	static int nbcpu = 0;
-	if (nbcpu == 0) {
-		nbcpu = sysconf(_SC_NPROCESSORS_ONLN);
-		if (nbcpu <= 0) nbcpu = 1;
-	}
-
-	uint64_t new_usage;
-	struct timespec now;
-	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
-		log_warn("top", "unable to get current time");
-		return;
+	static const char levels[] = " .:-=+*#%@";
+	if (!cpu->has_stat && cpu->ncpus == 0) return 0;
+	wprintw(win, "%12s", "");
+	if (cpu->has_stat)
+		wprintw(win, "usr %5.1f%% sys %5.1f%% ",
+		    cpu->user_percent, cpu->system_percent);
+	int x = getcurx(win);
+	if (cpu->ncpus > 0 && width - x > 2) {
+		waddch(win, '[' | A_BOLD | COLOR_PAIR(0));
+		for (int i = 0; i < cpu->ncpus && i < width - x - 3; i++) {
+			double percent = cpu->percent[i];
+			int level = percent / 10;
+			if (level > 9) level = 9;
+			if (level < 0) level = 0;
+			waddch(win, levels[level] | COLOR_PAIR((percent > 80)?2:
+				(percent > 50)?5:3));
+		}
+		waddch(win, ']' | A_BOLD | COLOR_PAIR(0));
 	}
-	new_usage = cg_cpu_usage(namespace, NULL);
+	return 1;
+}
 
-	uint64_t x, y;
-	x = ((uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec) -
-	    ((uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec);
-	y = new_usage - cpu_usage;
-	if (y > 0) {
-		double percent = (double) y * (double) 100. / (double) x / (double) nbcpu;
-		wprintw(win, "  ");
-		curses_gauge(win, (percent < 100)?percent:100, width - 4);
-		wprintw(win, "\n\n");
-	}
-	cpu_usage = new_usage;
-	memcpy(&ts, &now, sizeof(struct timespec));
+static void
+curses_global_cpu(WINDOW *win, struct ns_cpu *ns, int width)
+{
+	if (ns->percent < 0) return;
+	wprintw(win, "  ");
+	curses_gauge(win, (ns->percent < 100)?ns->percent:100, width - 4);
+	wprintw(win, "\n");
+	if (curses_cpu_detail(win, &ns->cpu, width))
+		wprintw(win, "\n");
+	wprintw(win, "\n");
 }
 
 #define GAUGE_SIZE 30
 static void
-curses_task(WINDOW *win, struct one_task *task, int width)
+curses_task(WINDOW *win, struct one_task *task, int width, int selected)
 {
 	int x, y;
-	wattron(win, A_BOLD);
-	wprintw(win, " %-10s ", task->name);
-	wattroff(win, A_BOLD);
-	wprintw(win, "%5d proc%s ",
-	    task->nb, (task->nb > 1)?"s":" ");
+	wprintw(win, "%c", task->expanded?'-':' ');
+	wattron(win, A_BOLD | (selected?A_REVERSE:0));
+	wprintw(win, "%-10s", task->name);
+	wattroff(win, A_BOLD | A_REVERSE);
+	wprintw(win, " ");
+	if (task->threads)
+		wprintw(win, "%5d thread%s ",
+		    task->nb, (task->nb > 1)?"s":" ");
+	else
+		wprintw(win, "%5d proc%s ",
+		    task->nb, (task->nb > 1)?"s":" ");
+	if (task->has_memory) {
+		char rss[16], cache[16];
+		wprintw(win, "%7s RSS %7s cache ",
+		    utils_human_size(task->memory.rss, rss, sizeof(rss)),
+		    utils_human_size(task->memory.cache, cache, sizeof(cache)));
+	}
+	if (task->events.memory[CG_MEMORY_LOW] ||
+	    task->events.memory[CG_MEMORY_THRESHOLD]) {
+		int color = task->events.memory[CG_MEMORY_CRITICAL]?2:5;
+		wattron(win, COLOR_PAIR(color));
+		wprintw(win, "pressure %" PRIu64 "/%" PRIu64 "/%" PRIu64
+		    " over %" PRIu64 " ",
+		    task->events.memory[CG_MEMORY_LOW],
+		    task->events.memory[CG_MEMORY_MEDIUM],
+		    task->events.memory[CG_MEMORY_CRITICAL],
+		    task->events.memory[CG_MEMORY_THRESHOLD]);
+		wattroff(win, COLOR_PAIR(color));
+	}
+	if (task->has_io && (task->io_read || task->io_write)) {
+		char rd[16], wr[16];
+		wprintw(win, "IO %7s/s R %7s/s W %5.0f op/s ",
+		    utils_human_size(task->io_read, rd, sizeof(rd)),
+		    utils_human_size(task->io_write, wr, sizeof(wr)),
+		    task->io_ops);
+	}
+	uint64_t ooms = task->events.memory[CG_MEMORY_OOM];
+	if (task->oom.oom > ooms) ooms = task->oom.oom;
+	if (ooms || task->oom.oom_kill || task->oom.under_oom) {
+		wattron(win, A_BOLD | COLOR_PAIR(2));
+		wprintw(win, "%sOOM %" PRIu64 " killed %" PRIu64 " ",
+		    task->oom.under_oom?"UNDER ":"",
+		    ooms, task->oom.oom_kill);
+		wattroff(win, A_BOLD | COLOR_PAIR(2));
+	}
 	if (task->cpu_usage > 0) {
 		getyx(win, y, x);
 		if (x > width - GAUGE_SIZE) {
@@ -225,137 +967,388 @@ curses_task(WINDOW *win, struct one_task *task, int width)
 		curses_gauge(win, task->cpu_percent, GAUGE_SIZE);
 	}
 	wprintw(win, "\n");
+
+	/* CPU detail and memory gauge below */
+	int gauge = task->mem_limit?(GAUGE_SIZE + 20):0;
+	int detail = curses_cpu_detail(win, &task->cpu, width - gauge);
+	if (gauge && width > gauge + 12) {
+		char usage[16], limit[16];
+		double percent = (double)task->mem_usage * 100. /
+		    (double)task->mem_limit;
+		getyx(win, y, x);
+		wmove(win, y, width - gauge - 1);
+		wprintw(win, "mem %7s/%-7s ",
+		    utils_human_size(task->mem_usage, usage, sizeof(usage)),
+		    utils_human_size(task->mem_limit, limit, sizeof(limit)));
+		curses_gauge(win, (percent < 100)?percent:100, GAUGE_SIZE);
+		detail = 1;
+	}
+	if (detail) wprintw(win, "\n");
 }
 
+/* Processes of an expanded task, as long as they fit in the window */
 static void
-curses_tasks(const char *namespace, void *arg)
+curses_pids(WINDOW *win, struct one_task *task, int width, int rows)
 {
-	TAILQ_HEAD(, one_task) *tasks = arg;
-	struct one_task *task;
-	int nb = 0;
-	TAILQ_FOREACH(task, tasks, next)
-	    nb++;
+	struct pid_detail *detail = &task->detail;
+	char rss[16];
+	if (getcury(win) >= rows - 1) return;
+	wattron(win, A_BOLD | COLOR_PAIR(4));
+	wprintw(win, "%12s %7s S %6s %7s %s\n", "",
+	    detail->threads?"TID":"PID", "CPU", "RSS", "COMMAND");
+	wattroff(win, A_BOLD | COLOR_PAIR(4));
+	for (size_t i = 0; i < detail->count && getcury(win) < rows - 1; i++) {
+		struct task_pid *p = &detail->pids[i];
+		wprintw(win, "%12s %7d ", "", p->pid);
+		wattron(win, COLOR_PAIR((p->stat.state == 'R')?3:
+			(p->stat.state == 'D' || p->stat.state == 'Z')?2:0));
+		wprintw(win, "%c", p->stat.state);
+		wattroff(win, COLOR_PAIR(3) | COLOR_PAIR(2));
+		wprintw(win, " %5.1f%% %7s ", p->cpu_percent,
+		    p->rss?utils_human_size(p->rss, rss, sizeof(rss)):"");
+		int left = width - getcurx(win) - 1;
+		if (left > 0)
+			waddnstr(win, p->cmdline?p->cmdline:p->stat.comm, left);
+		wprintw(win, "\n");
+	}
+}
+
+/* Draw the main window in the off-screen frame */
+static void
+curses_main(WINDOW *frame, struct task_table *tasks, struct ns_cpu *ns,
+    struct display *display)
+{
+	int nb = tasks->count, width = screen.width, rows = screen.rows;
+	werase(frame);
+	wmove(frame, 1, 0);
+
+	curses_global_cpu(frame, ns, width);
 
-	static int initialized = 0;
-	if (!initialized) {
-		curses_init();
-		initialized = 1;
+	/* Only draw tasks fitting in the window. The selected task is
+	 * followed when the sort order changes and kept visible. */
+	display->shown = 0;
+	if (display_sort(display, tasks) == -1 || nb == 0) return;
+	int top = getcury(frame);
+	for (int i = 0; i < nb; i++)
+		if (!strcmp(display->sorted[i]->name, display->selected)) {
+			display->cursor = i;
+			break;
+		}
+	if (display->cursor > nb - 1) display->cursor = nb - 1;
+	if (display->cursor < 0) display->cursor = 0;
+	strcpy(display->selected, display->sorted[display->cursor]->name);
+	if (display->first > display->cursor)
+		display->first = display->cursor;
+	for (;;) {
+		display->shown = 0;
+		for (int i = display->first;
+		     i < nb && getcury(frame) < rows - 1;
+		     i++, display->shown++) {
+			struct one_task *task = display->sorted[i];
+			curses_task(frame, task, width, i == display->cursor);
+			if (task->expanded)
+				curses_pids(frame, task, width, rows);
+		}
+		if (display->cursor < display->first + display->shown - 1 ||
+		    display->first >= display->cursor ||
+		    display->first + display->shown >= nb)
+			break;
+		/* Scroll down to show the selected task */
+		display->first += display->cursor -
+		    (display->first + display->shown - 2);
+		if (display->first > display->cursor)
+			display->first = display->cursor;
+		wmove(frame, top, 0);
+		wclrtobot(frame);
 	}
+}
 
-	int height, width;
-	getmaxyx(stdscr, height, width);
+static void
+curses_tasks(const char *namespace, struct task_table *tasks, struct ns_cpu *ns,
+    struct display *display)
+{
+	int nb = tasks->count;
+	if (screen.status == NULL) curses_init();
 
-	static WINDOW *logs_win = NULL;
-	if (logs_win == NULL && height > 10) {
-		logs_win = newwin(8, width, height - 8, 0);
-		scrollok(logs_win, TRUE);
-		log_register(curses_log, logs_win);
-	} else if (logs_win && height > 10) {
-		wresize(logs_win, 8, width);
-		wmove(logs_win, height - 8, 0);
-		wrefresh(logs_win);
-	} else if (logs_win) {
-		delwin(logs_win);
-		logs_win = NULL;
+	/* Main window, only rows which have changed are updated */
+	if (screen.frame) {
+		curses_main(screen.frame, tasks, ns, display);
+		curses_frame();
 	}
 
 	/* Status window */
-	static WINDOW *status_win = NULL;
-	if (status_win == NULL)
-		status_win = newwin(1, width, 0, 0);
-	else
-		wresize(status_win, 1, width);
-	werase(status_win);
-	wmove(status_win, 0, 0);
-	wattron(status_win, COLOR_PAIR(1));
-	wattron(status_win, A_BOLD);
-	wprintw(status_win, "Namespace: ");
-	wattroff(status_win, A_BOLD);
-	wprintw(status_win, "%-20s", namespace);
-	wattron(status_win, A_BOLD);
-	wprintw(status_win, "  Tasks: ");
-	wattroff(status_win, A_BOLD);
-	wprintw(status_win, "%-5d", nb);
-	for (int i=0; i < width; i++)
-		waddch(status_win, ' ');
-
-	/* Main window */
-	static WINDOW *main_win = NULL;
-	if (main_win == NULL)
-		main_win = newwin((height > 10)?(height - 8):height - 2, width,
-		    2, 0);
-	else
-		wresize(main_win, (height > 10)?(height - 8):height - 2, width);
-	werase(main_win);
-	wmove(main_win, 1, 0);
+	WINDOW *status = screen.status;
+	if (status) {
+		werase(status);
+		wattron(status, A_BOLD);
+		wprintw(status, "Namespace: ");
+		wattroff(status, A_BOLD);
+		wprintw(status, "%-20s", namespace);
+		wattron(status, A_BOLD);
+		wprintw(status, "  Tasks: ");
+		wattroff(status, A_BOLD);
+		wprintw(status, "%-5d", nb);
+		wattron(status, A_BOLD);
+		wprintw(status, "  Sort: ");
+		wattroff(status, A_BOLD);
+		wprintw(status, "%-6s", sort_keys[display->sort].name);
+		if (display->first > 0 || display->shown < nb)
+			wprintw(status, "  [%d-%d]",
+			    display->first + 1, display->first + display->shown);
+	}
 
-	curses_global_cpu(main_win, namespace, width);
-	TAILQ_FOREACH(task, tasks, next)
-	    curses_task(main_win, task, width);
+	/* Send everything to the terminal at once */
+	if (screen.logs) wnoutrefresh(screen.logs);
+	if (screen.main) wnoutrefresh(screen.main);
+	if (status) wnoutrefresh(status);
+	doupdate();
+}
 
-	if (logs_win) wrefresh(logs_win);
-	if (main_win) wrefresh(main_win);
-	if (status_win) wrefresh(status_win);
-	refresh();
+/**
+ * Refresh all tasks of the namespace.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+refresh_tasks(const char *namespace, struct task_table *tasks, struct ns_cpu *ns)
+{
+	tasks->generation++;
+	if (cg_iterate_tasks(namespace, one_task, tasks) == -1) {
+		log_warnx("top", "error while walking tasks");
+		return -1;
+	}
+
+	/* Remove tasks which have vanished */
+	table_sweep(tasks);
+	ns_cpu_refresh(namespace, ns);
+	return 0;
 }
 
-static int done = 0;
+/**
+ * Output one record per task, either as a compact line or as a JSON
+ * object.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+batch_tasks(const char *namespace, struct task_table *tasks, int json)
+{
+	struct one_task *task;
+	struct json out;
+	struct timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
+		log_warn("top", "unable to get current time");
+		return -1;
+	}
+	double ts = now.tv_sec + now.tv_nsec / 1e9;
+	json_init(&out, stdout, 0);
+	TAILQ_FOREACH(task, &tasks->list, next) {
+		if (!json) {
+			printf("%.3f %s %s cpu=%.1f count=%u threads=%s", ts,
+			    namespace, task->name, task->cpu_percent, task->nb,
+			    task->threads?"yes":"no");
+			if (task->has_memory)
+				printf(" memory=%" PRIu64 " rss=%" PRIu64
+				    " cache=%" PRIu64, task->mem_usage,
+				    task->memory.rss, task->memory.cache);
+			if (task->mem_limit)
+				printf(" limit=%" PRIu64, task->mem_limit);
+			if (task->has_io)
+				printf(" io_read=%.0f io_write=%.0f",
+				    task->io_read, task->io_write);
+			printf("\n");
+			continue;
+		}
+		json_object_start(&out);
+		json_key(&out, "time");
+		json_real(&out, ts);
+		json_key(&out, "namespace");
+		json_string(&out, namespace);
+		json_key(&out, "task");
+		json_string(&out, task->name);
+		json_key(&out, "cpu");
+		json_real(&out, task->cpu_percent);
+		json_key(&out, "count");
+		json_integer(&out, task->nb);
+		json_key(&out, "threads");
+		json_boolean(&out, task->threads);
+		if (task->has_memory) {
+			json_key(&out, "memory");
+			json_integer(&out, task->mem_usage);
+			json_key(&out, "rss");
+			json_integer(&out, task->memory.rss);
+			json_key(&out, "cache");
+			json_integer(&out, task->memory.cache);
+		}
+		if (task->mem_limit) {
+			json_key(&out, "limit");
+			json_integer(&out, task->mem_limit);
+		}
+		if (task->has_io) {
+			json_key(&out, "io_read");
+			json_integer(&out, (int64_t)task->io_read);
+			json_key(&out, "io_write");
+			json_integer(&out, (int64_t)task->io_write);
+		}
+		json_object_end(&out);
+	}
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		log_warn("top", "unable to write records");
+		return -1;
+	}
+	return 0;
+}
+
+/* Tell curses about the new size of the terminal */
 static void
-stop(int signum)
+curses_resize(void)
 {
-	done = 1;
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
+		log_warn("top", "unable to get terminal size");
+		return;
+	}
+	resizeterm(ws.ws_row, ws.ws_col);
+	curses_layout();
 }
+
 int
 cmd_top(const char *namespace, int argc, char * const argv[])
 {
-	int ch;
+	int ch, rc = -1;
+	double interval = 1;
+	int batch = 0, json = 0;
+	long count = 0, iterations = 0;
+	char *end;
 
-	while ((ch = getopt(argc, argv, "h")) != -1) {
+	while ((ch = getopt(argc, argv, "hi:bn:j")) != -1) {
 		switch (ch) {
 		case 'h':
 			usage();
 			return 0;
+		case 'i':
+			interval = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' ||
+			    interval < 0.1 || interval > 3600) {
+				usage();
+				return -1;
+			}
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'n':
+			count = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || count < 0) {
+				usage();
+				return -1;
+			}
+			break;
+		case 'j':
+			json = 1;
+			break;
 		default:
 			usage();
 			return -1;
 		}
 	}
+	if (!batch && (count || json)) {
+		usage();
+		return -1;
+	}
 
-	TAILQ_HEAD(, one_task) tasks;
-	TAILQ_INIT(&tasks);
+	struct task_table tasks;
+	struct ns_cpu ns = {};
+	struct display display = {};
+	int tfd = -1, sfd = -1;
+	table_init(&tasks);
 
-	signal(SIGINT, stop);
+	/* The timer is periodic: a late wakeup does not delay the next
+	 * ones. Signals are received through a file descriptor to not
+	 * interrupt curses in the middle of something. */
+	struct itimerspec its = {};
+	its.it_interval.tv_sec = (time_t)interval;
+	its.it_interval.tv_nsec = (interval - (time_t)interval) * 1e9;
+	its.it_value = its.it_interval;
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1 ||
+	    timerfd_settime(tfd, 0, &its, NULL) == -1) {
+		log_warn("top", "unable to setup refresh timer");
+		goto end;
+	}
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (!batch) sigaddset(&mask, SIGWINCH);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1 ||
+	    (sfd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1) {
+		log_warn("top", "unable to setup signal handling");
+		goto end;
+	}
 
-	do {
-		/* Mark current tasks as invalid */
-		struct one_task *task, *task_next;
-		TAILQ_FOREACH(task, &tasks, next) {
-			task->valid = 0;
-		}
+	/* In batch mode, the first refresh is only a baseline for deltas */
+	if (refresh_tasks(namespace, &tasks, &ns) == -1) goto end;
+	if (!batch) curses_tasks(namespace, &tasks, &ns, &display);
 
-		/* Refresh */
-		if (cg_iterate_tasks(namespace, one_task, &tasks) == -1) {
-			log_warnx("ls", "error while walking tasks");
-			return -1;
+	struct pollfd fds[] = {
+		{ .fd = tfd, .events = POLLIN },
+		{ .fd = sfd, .events = POLLIN },
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+	};
+	for (;;) {
+		if (poll(fds, batch?2:3, -1) == -1) {
+			if (errno == EINTR) continue;
+			log_warn("top", "unable to wait for events");
+			goto end;
 		}
-
-		/* Remove invalid tasks */
-		for (task = TAILQ_FIRST(&tasks);
-		     task != NULL;
-		     task = task_next) {
-			task_next = TAILQ_NEXT(task, next);
-			if (task->valid == 0) {
-				TAILQ_REMOVE(&tasks, task, next);
-				free(task->name);
-				free(task);
+		if (fds[0].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(tfd, &expirations, sizeof(expirations)) == -1 &&
+			    errno != EAGAIN) {
+				log_warn("top", "unable to read refresh timer");
+				goto end;
 			}
+			if (refresh_tasks(namespace, &tasks, &ns) == -1) goto end;
+			if (!batch)
+				curses_tasks(namespace, &tasks, &ns, &display);
+			else if (batch_tasks(namespace, &tasks, json) == -1)
+				goto end;
+			else if (count && ++iterations >= count)
+				break;
 		}
+		if (fds[1].revents & POLLIN) {
+			struct signalfd_siginfo si;
+			if (read(sfd, &si, sizeof(si)) != sizeof(si)) {
+				log_warn("top", "unable to read signal");
+				goto end;
+			}
+			if (si.ssi_signo != SIGWINCH) break;
+			curses_resize();
+			curses_tasks(namespace, &tasks, &ns, &display);
+		}
+		if (fds[2].revents & (POLLHUP|POLLERR)) break;
+		if (fds[2].revents & POLLIN) {
+			int key, redraw = 0;
+			while ((key = getch()) != ERR) {
+				if (key == 'q' || key == 'Q') goto quit;
+				redraw |= display_key(&display, &tasks, key);
+			}
+			if (redraw)
+				curses_tasks(namespace, &tasks, &ns, &display);
+		}
+	}
+quit:
+	rc = 0;
 
-		curses_tasks(namespace, &tasks);
-
-		sleep(1);
-	} while (!done);
-
-	endwin();
-	return 0;
+end:
+	if (!batch && screen.status) {
+		log_register(NULL, NULL);
+		endwin();
+	}
+	if (tfd != -1) close(tfd);
+	if (sfd != -1) close(sfd);
+	ns_cpu_free(&ns);
+	free(display.sorted);
+	table_free(&tasks);
+	return rc;
 }
@@ -19,6 +19,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
@@ -302,3 +303,113 @@ utils_cmdline(pid_t pid)
 	return command;
 
 }
+
+/**
+ * Format a size in bytes in a human readable way.
+ *
+ * @param size Size in bytes.
+ * @param buf  Buffer to store the result.
+ * @param len  Size of the buffer.
+ * @return the buffer
+ */
+char *
+utils_human_size(uint64_t size, char *buf, size_t len)
+{
+	const char *units = "BKMGTPE";
+	double value = size;
+	while (value >= 1024 && units[1] != '\0') {
+		value /= 1024;
+		units++;
+	}
+	if (*units == 'B')
+		snprintf(buf, len, "%" PRIu64 "B", size);
+	else
+		snprintf(buf, len, "%.1f%c", value, *units);
+	return buf;
+}
+
+/**
+ * Get resident memory of a given PID.
+ *
+ * @param pid PID to get resident memory for.
+ * @return resident memory in bytes or 0 if not found
+ */
+uint64_t
+utils_rss(pid_t pid)
+{
+	char path[64];
+	long long unsigned size, resident;
+	snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+	FILE *statm = fopen(path, "r");
+	if (statm == NULL) return 0; /* Vanished? */
+	int n = fscanf(statm, "%llu %llu", &size, &resident);
+	fclose(statm);
+	if (n != 2) return 0;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Get state and CPU usage of a given PID from /proc/PID/stat.
+ *
+ * @param pid  PID (or thread ID) to get statistics for.
+ * @param stat Where to store statistics.
+ * @return 0 on success, -1 if the PID has vanished
+ */
+int
+utils_proc_stat(pid_t pid, struct proc_stat *stat)
+{
+	char path[64], buf[512];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return -1;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) return -1;
+	buf[n] = '\0';
+
+	/* The command name may contain spaces and parentheses */
+	char *start = strchr(buf, '('), *end = strrchr(buf, ')');
+	if (start == NULL || end == NULL || end < start) return -1;
+	size_t len = end - start - 1;
+	if (len >= sizeof(stat->comm)) len = sizeof(stat->comm) - 1;
+	memcpy(stat->comm, start + 1, len);
+	stat->comm[len] = '\0';
+
+	long long unsigned utime, stime;
+	if (sscanf(end + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+		&stat->state, &utime, &stime) != 3)
+		return -1;
+	static long ticks = 0;
+	if (ticks == 0 && (ticks = sysconf(_SC_CLK_TCK)) <= 0) ticks = 100;
+	stat->cpu = (utime + stime) * (1000000000ULL / ticks);
+	return 0;
+}
+
+/**
+ * Parse a block device.
+ *
+ * @param spec   Either "MAJOR:MINOR" or a path to a block device.
+ * @param device Where to store the device number.
+ * @return 0 on success, -1 on error
+ */
+int
+utils_parse_device(const char *spec, dev_t *device)
+{
+	unsigned maj, min;
+	char c;
+	if (sscanf(spec, "%u:%u%c", &maj, &min, &c) == 2) {
+		*device = makedev(maj, min);
+		return 0;
+	}
+	struct stat a;
+	if (stat(spec, &a) == -1) {
+		log_warn("utils", "unable to find device %s", spec);
+		return -1;
+	}
+	if (!S_ISBLK(a.st_mode)) {
+		log_warnx("utils", "%s is not a block device", spec);
+		return -1;
+	}
+	*device = a.st_rdev;
+	return 0;
+}
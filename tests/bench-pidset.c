@@ -0,0 +1,97 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vincent.bernat@dailymotion.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "lanco.h"
+
+#include <string.h>
+#include <time.h>
+#include <sys/queue.h>
+
+/*
+ * Microbenchmark of PID de-duplication: a list walked for each PID, as
+ * done before, against a PID set. Each PID is added twice, as when the
+ * tasks file is read while processes are created.
+ */
+
+struct one_pid {
+	TAILQ_ENTRY(one_pid) next;
+	pid_t pid;
+};
+TAILQ_HEAD(pid_list, one_pid);
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
+static int
+list_add(struct pid_list *pids, pid_t pid)
+{
+	struct one_pid *p;
+	TAILQ_FOREACH(p, pids, next)
+	    if (p->pid == pid) return 0;
+	if ((p = malloc(sizeof(struct one_pid))) == NULL) return -1;
+	p->pid = pid;
+	TAILQ_INSERT_TAIL(pids, p, next);
+	return 1;
+}
+
+static void
+list_free(struct pid_list *pids)
+{
+	struct one_pid *p;
+	while ((p = TAILQ_FIRST(pids)) != NULL) {
+		TAILQ_REMOVE(pids, p, next);
+		free(p);
+	}
+}
+
+int
+main(void)
+{
+	static const int sizes[] = { 1000, 10000, 100000 };
+
+	printf("%8s %12s %12s\n", "PIDs", "list", "set");
+	for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		pid_t *input = malloc(2 * n * sizeof(pid_t));
+		if (input == NULL) return 1;
+		for (int i = 0; i < n; i++)
+			input[i] = input[n + i] = 1000 + i * 7;
+
+		double t0 = now();
+		struct pid_list list;
+		TAILQ_INIT(&list);
+		for (int i = 0; i < 2 * n; i++)
+			if (list_add(&list, input[i]) == -1) return 1;
+		list_free(&list);
+		double t1 = now();
+		struct pidset set;
+		pidset_init(&set);
+		for (int i = 0; i < 2 * n; i++)
+			if (pidset_add(&set, input[i]) == -1) return 1;
+		pidset_free(&set);
+		double t2 = now();
+
+		printf("%8d %9.2f ms %9.2f ms\n", n, t1 - t0, t2 - t1);
+		free(input);
+	}
+	return 0;
+}
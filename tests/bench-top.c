@@ -0,0 +1,151 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vincent.bernat@dailymotion.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the maintenance of the task table of top on each
+ * refresh: a list scanned for each task, as done before, against the hash
+ * table. On each refresh, 1% of the tasks are replaced by new ones. The
+ * source of top is included to get access to its static functions.
+ */
+
+#include "../src/top.c"
+
+#include <time.h>
+
+#define ROUNDS 20
+
+struct list_task {
+	TAILQ_ENTRY(list_task) next;
+	int valid;
+	char *name;
+};
+TAILQ_HEAD(list_tasks, list_task);
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
+static int
+list_refresh(struct list_tasks *tasks, char **names, int n)
+{
+	struct list_task *task, *task_next;
+	TAILQ_FOREACH(task, tasks, next)
+	    task->valid = 0;
+	for (int i = 0; i < n; i++) {
+		TAILQ_FOREACH(task, tasks, next)
+		    if (!strcmp(task->name, names[i])) break;
+		if (task == NULL) {
+			if ((task = calloc(1, sizeof(struct list_task))) == NULL ||
+			    (task->name = strdup(names[i])) == NULL)
+				return -1;
+			TAILQ_INSERT_TAIL(tasks, task, next);
+		}
+		task->valid = 1;
+	}
+	for (task = TAILQ_FIRST(tasks); task != NULL; task = task_next) {
+		task_next = TAILQ_NEXT(task, next);
+		if (task->valid) continue;
+		TAILQ_REMOVE(tasks, task, next);
+		free(task->name);
+		free(task);
+	}
+	return 0;
+}
+
+static int
+hash_refresh(struct task_table *table, char **names, int n)
+{
+	table->generation++;
+	for (int i = 0; i < n; i++) {
+		uint32_t hash = table_hash(names[i]);
+		struct one_task *task = table_lookup(table, names[i], hash);
+		if (task == NULL &&
+		    (task = table_insert(table, names[i], hash)) == NULL)
+			return -1;
+		task->generation = table->generation;
+	}
+	table_sweep(table);
+	return 0;
+}
+
+/* Name all the tasks, then rename 1% of them for each round */
+static void
+names_set(char **names, int n, int round)
+{
+	if (round == 0) {
+		for (int i = 0; i < n; i++)
+			snprintf(names[i], NAME_MAX + 1, "task-%d", i);
+		return;
+	}
+	for (int i = 0; i < n / 100; i++)
+		snprintf(names[(round * 7919 + i * 31) % n], NAME_MAX + 1,
+		    "new-%d-%d", round, i);
+}
+
+int
+main(void)
+{
+	static const int sizes[] = { 100, 1000, 10000, 20000 };
+
+	printf("%8s %12s %12s (per refresh)\n", "tasks", "list", "hash table");
+	for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		char **names = calloc(n, sizeof(char *));
+		if (names == NULL) return 1;
+		for (int i = 0; i < n; i++)
+			if ((names[i] = malloc(NAME_MAX + 1)) == NULL) return 1;
+
+		struct list_tasks list;
+		TAILQ_INIT(&list);
+		names_set(names, n, 0);
+		if (list_refresh(&list, names, n) == -1) return 1;
+		double t0 = now();
+		for (int r = 1; r <= ROUNDS; r++) {
+			names_set(names, n, r);
+			if (list_refresh(&list, names, n) == -1) return 1;
+		}
+		double t1 = now();
+
+		struct task_table table;
+		table_init(&table);
+		names_set(names, n, 0);
+		if (hash_refresh(&table, names, n) == -1) return 1;
+		double t2 = now();
+		for (int r = 1; r <= ROUNDS; r++) {
+			names_set(names, n, r);
+			if (hash_refresh(&table, names, n) == -1) return 1;
+		}
+		double t3 = now();
+
+		printf("%8d %9.3f ms %9.3f ms\n", n,
+		    (t1 - t0) / ROUNDS, (t3 - t2) / ROUNDS);
+		table_free(&table);
+		struct list_task *task;
+		while ((task = TAILQ_FIRST(&list)) != NULL) {
+			TAILQ_REMOVE(&list, task, next);
+			free(task->name);
+			free(task);
+		}
+		for (int i = 0; i < n; i++) free(names[i]);
+		free(names);
+	}
+	return 0;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+
+# Remove a task while its processes are being dumped. The dump is blocked
+# in the middle of the process list by a pipe which is not read, the task
+# is stopped and its cgroup removed, then the pipe is drained. Each
+# document should be valid JSON and the stream should not stop. This needs
+# to be run as root on a host with cgroups.
+
+LANCO=${LANCO:-../src/lanco}
+NS=check
+PROCS=3000
+TMP=dump-vanish.$$
+
+[ "$(id -u)" -eq 0 ] || { echo "SKIP: needs root"; exit 77; }
+command -v python3 > /dev/null || { echo "SKIP: needs python3"; exit 77; }
+$LANCO $NS init 2> /dev/null || { echo "SKIP: unable to init namespace"; exit 77; }
+
+cleanup() {
+    [ -z "$DUMP" ] || kill $DUMP 2> /dev/null
+    $LANCO $NS stop -a 2> /dev/null
+    rm -f $TMP.*
+}
+trap cleanup EXIT
+
+# Enough processes for the output to fill the pipe before the end of
+# the process list.
+$LANCO $NS run big sh -c "
+    i=0
+    while [ \$i -lt $PROCS ]; do sleep 60 & i=\$((i+1)); done
+    touch $PWD/$TMP.ready
+    wait" || exit 1
+while [ ! -f $TMP.ready ]; do sleep 0.1; done
+
+mkfifo $TMP.fifo || exit 1
+$LANCO $NS dump -w 1 > $TMP.fifo &
+DUMP=$!
+exec 3< $TMP.fifo
+sleep 1
+$LANCO $NS stop big || exit 1
+while $LANCO $NS check big 2> /dev/null; do sleep 0.1; done
+cat <&3 > $TMP.out &
+sleep 3
+kill -0 $DUMP 2> /dev/null || { echo "FAIL: dump has stopped"; exit 1; }
+kill $DUMP; wait $DUMP; DUMP=
+exec 3<&-
+wait
+
+python3 - $TMP.out <<'PY' || exit 1
+import json, sys
+documents = 0
+for line in open(sys.argv[1]):
+    try:
+        document = json.loads(line)
+    except ValueError as e:
+        sys.exit("FAIL: invalid document {}: {}".format(documents + 1, e))
+    if documents == 0 and "big" not in document["tasks"]:
+        sys.exit("FAIL: task missing from the first document")
+    documents += 1
+if documents < 2:
+    sys.exit("FAIL: only {} document(s)".format(documents))
+print("{} documents".format(documents))
+PY